@@ -0,0 +1,29 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#ifndef __CPU_AOT_H__
+#define __CPU_AOT_H__
+
+#include <common.h>
+
+void aot_set_dir(const char *dir);
+void aot_load(long img_size);
+uint64_t aot_exec(uint64_t n);
+void aot_invalidate(paddr_t addr, int len);
+void aot_statistic();
+bool aot_page_translated(paddr_t page);
+
+#endif
@@ -21,8 +21,20 @@
 void cpu_exec(uint64_t n);
 
 void set_nemu_state(int state, vaddr_t pc, int halt_ret);
+// end the current run of instructions after this one, see execute()
+void cpu_end_run();
+// instructions run so far, also in the middle of a run of them
+uint64_t cpu_icount();
+// the guest waits for an interrupt, called by an ISA which decodes e.g. wfi
+void cpu_idle();
 void invalid_inst(vaddr_t thispc);
 
+// instrumentation which can be switched at runtime, if it is compiled in
+#define INSTR_ITRACE     0x1
+#define INSTR_DIFFTEST   0x2
+#define INSTR_WATCHPOINT 0x4
+bool cpu_instrument(int what, bool enable);
+
 #define NEMUTRAP(thispc, code) set_nemu_state(NEMU_END, thispc, code)
 #define INV(thispc) invalid_inst(thispc)
 
@@ -18,14 +18,57 @@
 
 #include <isa.h>
 
+// an instruction whose decoding result is remembered by the decode cache
+typedef struct {
+  vaddr_t pc;
+  const void *handler;  // execute body of the matched INSTPAT, NULL if not decoded
+  uint32_t inst;
+  uint8_t ilen;
+  uint8_t rd, rs1, rs2; // register indices, 0 if the operand is not used
+  word_t imm;
+  IFDEF(CONFIG_INSTPAT_NAME, const char *name); // name of the matched INSTPAT
+  bool decode_only; // only record the decoding result, without executing it
+} DecodeEntry;
+
 typedef struct Decode {
   vaddr_t pc;
   vaddr_t snpc; // static next pc
   vaddr_t dnpc; // dynamic next pc
   ISADecodeInfo isa;
+  IFDEF(CONFIG_DCACHE, DecodeEntry *de);
+  IFDEF(CONFIG_ENGINE_THREADED, uint64_t nr_left); // instructions allowed to run in this block
   IFDEF(CONFIG_ITRACE, char logbuf[128]);
 } Decode;
 
+// --- decode cache ---
+// instructions are cached in this granularity, which is also their length
+#define DCACHE_ALIGN 4
+
+DecodeEntry* dcache_lookup(vaddr_t pc);
+// count the instruction just decoded into its page
+void dcache_decoded(DecodeEntry *e);
+void dcache_invalidate(paddr_t addr, int len);
+void dcache_flush();
+void dcache_statistic();
+DecodeEntry** dcache_page_table();
+const uint16_t* dcache_live_table();
+// whether writes to the page should invalidate decoded or translated code
+bool dcache_page_cached(paddr_t page);
+
+// --- decoded instructions kept across runs, see tcache.c ---
+void tcache_init(const char *dir);
+void tcache_load(paddr_t page, DecodeEntry *entries);
+void tcache_statistic();
+
+#ifdef CONFIG_DCACHE
+static inline uint32_t dcache_fetch(Decode *s) {
+  s->snpc += s->de->ilen;
+  return s->de->inst;
+}
+#else
+static inline uint32_t dcache_fetch(Decode *s) { return 0; }
+#endif
+
 // --- pattern matching mechanism ---
 __attribute__((always_inline))
 static inline void pattern_decode(const char *str, int len,
@@ -87,16 +130,87 @@ finish:
 
 
 // --- pattern matching wrappers for decode ---
+#ifdef CONFIG_DCACHE
+// Record the decoding result, and label the execute body with the line of
+// INSTPAT so that a later hit can jump to it directly.
+#define INSTPAT_EXEC(s, id, ...) \
+  (s)->de->handler = &&concat(__instpat_exec_, __LINE__); \
+  (s)->de->inst = INSTPAT_INST(s); \
+  (s)->de->ilen = (s)->snpc - (s)->pc; \
+  (s)->de->rd = rd; \
+  (s)->de->imm = imm; \
+  IFDEF(CONFIG_INSTPAT_NAME, (s)->de->name = str(id)); \
+  dcache_decoded((s)->de); \
+  if ((s)->de->decode_only) goto *(__instpat_end); \
+  concat(__instpat_exec_, __LINE__): __VA_ARGS__
+
+#define INSTPAT_CACHED(s) ((s)->de->handler != NULL)
+
+#define INSTPAT_DISPATCH(s) do { \
+  rd = (s)->de->rd; \
+  src1 = R((s)->de->rs1); \
+  src2 = R((s)->de->rs2); \
+  imm = (s)->de->imm; \
+  goto *((s)->de->handler); \
+} while (0)
+
+#define INSTPAT_HIT(s) if (INSTPAT_CACHED(s)) INSTPAT_DISPATCH(s)
+#else
+#define INSTPAT_EXEC(s, id, ...) __VA_ARGS__
+#define INSTPAT_CACHED(s) false
+#define INSTPAT_HIT(s)
+#endif
+
+#ifdef CONFIG_ENGINE_THREADED
+// Go on with the next instruction in the same block without returning to
+// the execution loop. The block ends at a control transfer, a change of
+// `nemu_state`, the end of the budget, or an instruction not decoded yet.
+// Nothing is run after an instruction which is only decoded.
+#define INSTPAT_NEXT(s) do { \
+  DecodeEntry *next = (s)->de + (s)->de->ilen / DCACHE_ALIGN; \
+  if (likely(!(s)->de->decode_only && -- (s)->nr_left > 0 && (s)->dnpc == (s)->snpc && \
+        nemu_state.state == NEMU_RUNNING && next->handler != NULL)) { \
+    (s)->de = next; \
+    (s)->pc = cpu.pc = (s)->snpc; \
+    (s)->isa.inst.val = next->inst; \
+    (s)->dnpc = (s)->snpc = (s)->pc + next->ilen; \
+    INSTPAT_DISPATCH(s); \
+  } \
+} while (0)
+#else
+#define INSTPAT_NEXT(s)
+#endif
+
+#ifdef CONFIG_INSTPAT_TREE
+#include <generated/instpat-tree.h>
+
+// The generated decoder finds the first matched pattern, and jumps to its
+// label, which is named with the line of INSTPAT as the generator does.
+#define INSTPAT_LABEL() concat(__instpat_match_, __LINE__):
+
+#define INSTPAT_TREE(s) do { \
+  static const void *__instpat_tree[] = INSTPAT_TREE_TABLE; \
+  int idx = instpat_tree(INSTPAT_INST(s)); \
+  goto *(idx >= 0 ? __instpat_tree[idx] : __instpat_end); \
+} while (0)
+#else
+#define INSTPAT_LABEL()
+#define INSTPAT_TREE(s)
+#endif
+
 #define INSTPAT(pattern, ...) do { \
   uint64_t key, mask, shift; \
   pattern_decode(pattern, STRLEN(pattern), &key, &mask, &shift); \
   if ((((uint64_t)INSTPAT_INST(s) >> shift) & mask) == key) { \
+    INSTPAT_LABEL() \
     INSTPAT_MATCH(s, ##__VA_ARGS__); \
     goto *(__instpat_end); \
   } \
 } while (0)
 
-#define INSTPAT_START(name) { const void ** __instpat_end = &&concat(__instpat_end_, name);
+#define INSTPAT_START(name) { static const void * __instpat_end = &&concat(__instpat_end_, name); \
+  INSTPAT_HIT(s); \
+  INSTPAT_TREE(s);
 #define INSTPAT_END(name)   concat(__instpat_end_, name): ; }
 
 #endif
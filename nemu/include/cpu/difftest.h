@@ -24,6 +24,7 @@ void difftest_skip_ref();
 void difftest_skip_dut(int nr_ref, int nr_dut);
 void difftest_set_patch(void (*fn)(void *arg), void *arg);
 void difftest_step(vaddr_t pc, vaddr_t npc);
+void difftest_step_block(vaddr_t pc, vaddr_t npc, uint64_t n);
 void difftest_detach();
 void difftest_attach();
 #else
@@ -31,6 +32,7 @@ static inline void difftest_skip_ref() {}
 static inline void difftest_skip_dut(int nr_ref, int nr_dut) {}
 static inline void difftest_set_patch(void (*fn)(void *arg), void *arg) {}
 static inline void difftest_step(vaddr_t pc, vaddr_t npc) {}
+static inline void difftest_step_block(vaddr_t pc, vaddr_t npc, uint64_t n) {}
 static inline void difftest_detach() {}
 static inline void difftest_attach() {}
 #endif
@@ -13,12 +13,15 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
-#ifndef __DEVICE_ALARM_H__
-#define __DEVICE_ALARM_H__
+#ifndef __CPU_JIT_H__
+#define __CPU_JIT_H__
 
-#define TIMER_HZ 60
+#include <common.h>
 
-typedef void (*alarm_handler_t) ();
-void add_alarm_handle(alarm_handler_t h);
+uint64_t jit_exec(uint64_t n);
+void jit_invalidate(paddr_t addr, int len);
+void jit_flush();
+void jit_set_fusion(bool enable);
+void jit_statistic();
 
 #endif
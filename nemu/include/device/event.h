@@ -0,0 +1,43 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#ifndef __DEVICE_EVENT_H__
+#define __DEVICE_EVENT_H__
+
+#include <common.h>
+
+#define TIMER_HZ 60
+
+// Events of devices are scheduled in virtual time, whose unit is us, and
+// run by device_update() between runs of instructions, so that the CPU
+// runs until the next deadline without checking the time.
+typedef void (*event_handler_t) ();
+
+// Run the handler `delay' us later, and then every `period' us if it is
+// not 0.
+void event_add(const char *name, uint64_t delay, uint64_t period, event_handler_t h);
+// the virtual time of the last update
+uint64_t event_now();
+// the deadline of the earliest event, or UINT64_MAX
+uint64_t event_next();
+// run the events due at `now'
+void event_run(uint64_t now);
+// the current virtual time, see device.c
+uint64_t device_time();
+// the guest waits for the time to pass, or for an interrupt if `intr'
+void device_idle(bool intr);
+
+#endif
@@ -34,17 +34,30 @@ static inline bool map_inside(IOMap *map, paddr_t addr) {
   return (addr >= map->low && addr <= map->high);
 }
 
-static inline int find_mapid_by_addr(IOMap *maps, int size, paddr_t addr) {
-  int i;
-  for (i = 0; i < size; i ++) {
-    if (map_inside(maps + i, addr)) {
-      difftest_skip_ref();
-      return i;
-    }
-  }
-  return -1;
+// The maps of an address space below 4 GiB, found in O(1) by a directory
+// of 4 MiB entries pointing to tables of pages. A page is either covered
+// by one map, or shared by several ones, whose entry then points to the
+// map of each byte of the page, tagged by IO_SHARED.
+#define IO_DIR_SHIFT  22
+#define IO_PAGE_SHIFT 12
+#define IO_SHARED     1
+typedef struct {
+  uintptr_t *dir[1 << (32 - IO_DIR_SHIFT)];
+} IOTable;
+
+static inline IOMap* io_table_find(IOTable *t, paddr_t addr) {
+  if (MUXDEF(PMEM64, addr >> 32, 0)) return NULL;
+  const uintptr_t *pt = t->dir[(uint32_t)addr >> IO_DIR_SHIFT];
+  if (pt == NULL) return NULL;
+  uintptr_t e = pt[((uint32_t)addr >> IO_PAGE_SHIFT) & ((1 << (IO_DIR_SHIFT - IO_PAGE_SHIFT)) - 1)];
+  if (unlikely(e & IO_SHARED)) e = ((const uintptr_t *)(e & ~IO_SHARED))[addr & ((1 << IO_PAGE_SHIFT) - 1)];
+  return (IOMap *)e;
 }
 
+// Add the map into the table, and return NULL, or the map overlapped with
+// it, which is not added.
+IOMap* io_table_add(IOTable *t, IOMap *map);
+
 void add_pio_map(const char *name, ioaddr_t addr,
         void *space, uint32_t len, io_callback_t callback);
 void add_mmio_map(const char *name, paddr_t addr,
@@ -20,5 +20,8 @@
 
 word_t mmio_read(paddr_t addr, int len);
 void mmio_write(paddr_t addr, int len, word_t data);
+// host address of addr, if its whole page is in a map without callback,
+// which is accessed as memory, or NULL
+uint8_t* mmio_to_host(paddr_t addr);
 
 #endif
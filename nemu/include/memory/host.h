@@ -18,22 +18,32 @@
 
 #include <common.h>
 
+// accessors of each size, for callers which know the size statically
+#define HOST_ACCESSOR(bits) \
+  static inline uint##bits##_t host_read_u##bits(void *addr) { return *(uint##bits##_t *)addr; } \
+  static inline void host_write_u##bits(void *addr, uint##bits##_t data) { *(uint##bits##_t *)addr = data; }
+
+HOST_ACCESSOR(8)
+HOST_ACCESSOR(16)
+HOST_ACCESSOR(32)
+HOST_ACCESSOR(64)
+
 static inline word_t host_read(void *addr, int len) {
   switch (len) {
-    case 1: return *(uint8_t  *)addr;
-    case 2: return *(uint16_t *)addr;
-    case 4: return *(uint32_t *)addr;
-    IFDEF(CONFIG_ISA64, case 8: return *(uint64_t *)addr);
+    case 1: return host_read_u8(addr);
+    case 2: return host_read_u16(addr);
+    case 4: return host_read_u32(addr);
+    IFDEF(CONFIG_ISA64, case 8: return host_read_u64(addr));
     default: MUXDEF(CONFIG_RT_CHECK, assert(0), return 0);
   }
 }
 
 static inline void host_write(void *addr, int len, word_t data) {
   switch (len) {
-    case 1: *(uint8_t  *)addr = data; return;
-    case 2: *(uint16_t *)addr = data; return;
-    case 4: *(uint32_t *)addr = data; return;
-    IFDEF(CONFIG_ISA64, case 8: *(uint64_t *)addr = data; return);
+    case 1: host_write_u8(addr, data); return;
+    case 2: host_write_u16(addr, data); return;
+    case 4: host_write_u32(addr, data); return;
+    IFDEF(CONFIG_ISA64, case 8: host_write_u64(addr, data); return);
     IFDEF(CONFIG_RT_CHECK, default: assert(0));
   }
 }
@@ -17,6 +17,7 @@
 #define __MEMORY_PADDR_H__
 
 #include <common.h>
+#include <memory/host.h>
 
 #define PMEM_LEFT  ((paddr_t)CONFIG_MBASE)
 #define PMEM_RIGHT ((paddr_t)CONFIG_MBASE + CONFIG_MSIZE - 1)
@@ -31,7 +32,71 @@ static inline bool in_pmem(paddr_t addr) {
   return addr - CONFIG_MBASE < CONFIG_MSIZE;
 }
 
+// Map the file copy-on-write at addr, so that pages not touched are never
+// copied. Return false if pmem can not be mapped.
+bool paddr_map_file(paddr_t addr, int fd, size_t size);
+// The memfd backing pmem with CONFIG_PMEM_MEMFD, or -1. Other processes
+// may map it by /proc/<pid>/fd/<fd>, or get it passed over a socket, and
+// should follow these rules:
+// - NEMU owns it, and the content is only defined while NEMU is alive.
+// - The content is consistent when NEMU is stopped, e.g. in sdb or between
+//   steps of difftest. While the guest runs, readers may see any partial
+//   order of its stores.
+// - Other processes should only map it read-only, since NEMU does not see
+//   their writes, e.g. the decoded instructions and the dirty pages.
+int paddr_memfd();
+// make pmem accessible to system calls, e.g. read() into it, which can
+// not fill pages lazily
+void paddr_touch(paddr_t addr, size_t len);
+
+// --- dirty pages ---
+// One bit for each page of pmem, indexed by (paddr - CONFIG_MBASE) / PAGE_SIZE,
+// which is set when the page is written.
+#define PMEM_NR_PAGE (CONFIG_MSIZE >> 12)
+#define PMEM_DIRTY_WORDS ((PMEM_NR_PAGE + 63) / 64)
+bool paddr_dirty(paddr_t addr);
+const uint64_t* paddr_dirty_bitmap();
+// Copy the pages written since the last call into bitmap, unless it is
+// NULL, and clear them. The bitmap is shared by all of its users.
+void paddr_dirty_fetch_clear(uint64_t *bitmap);
+
+// --- regions of memory besides pmem, see region.c ---
+typedef struct {
+  const char *name;
+  paddr_t base, size;
+  uint8_t *host;
+  const char *file; // the initial content
+  bool rom;
+} MemRegion;
+
+#ifndef CONFIG_TARGET_AM
+void init_regions();
+// the region containing addr, or NULL
+const MemRegion* region_of(paddr_t addr);
+#else
+static inline void init_regions() {}
+static inline const MemRegion* region_of(paddr_t addr) { return NULL; }
+#endif
+// host address of addr if its page can be accessed directly, or NULL
+uint8_t* paddr_to_host(paddr_t addr, bool write);
+
 word_t paddr_read(paddr_t addr, int len);
 void paddr_write(paddr_t addr, int len, word_t data);
 
+// Accessors of each size. Reads of pmem are inlined, and the others are
+// taken by paddr_read() and paddr_write().
+#define PADDR_ACCESSOR(bits) \
+  static inline uint##bits##_t paddr_read_u##bits(paddr_t addr) { \
+    if (likely(in_pmem(addr))) return host_read_u##bits(guest_to_host(addr)); \
+    return paddr_read(addr, bits / 8); \
+  } \
+  static inline void paddr_write_u##bits(paddr_t addr, uint##bits##_t data) { \
+    paddr_write(addr, bits / 8, data); \
+  }
+
+PADDR_ACCESSOR(8)
+PADDR_ACCESSOR(16)
+PADDR_ACCESSOR(32)
+IFDEF(CONFIG_ISA64, PADDR_ACCESSOR(64))
+
 #endif
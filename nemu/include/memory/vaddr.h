@@ -16,14 +16,95 @@
 #ifndef __MEMORY_VADDR_H__
 #define __MEMORY_VADDR_H__
 
-#include <common.h>
+#include <isa.h>
+#include <memory/host.h>
 
 word_t vaddr_ifetch(vaddr_t addr, int len);
 word_t vaddr_read(vaddr_t addr, int len);
 void vaddr_write(vaddr_t addr, int len, word_t data);
 
+// Flush the translations cached by the TLB, when the page table or the
+// address space is switched, e.g. satp is written or sfence.vma is run,
+// and when translation is turned on or off.
+void tlb_flush();
+void tlb_flush_page(vaddr_t vaddr);
+// writes to this physical page should be noticed from now on
+void tlb_flush_write(paddr_t page);
+
+// --- data watchpoints, see watchpoint.c ---
+#ifdef CONFIG_WATCHPOINT
+// the types of accesses watched by any data watchpoint, as 1 << MEM_TYPE_*
+extern int wp_mem_types;
+// whether some range watched for the type of access overlaps the page
+bool wp_mem_page(vaddr_t vpage, paddr_t ppage, int type);
+// stop the execution if the access hits a data watchpoint
+void wp_mem_check(vaddr_t vaddr, paddr_t paddr, int len, int type);
+#else
+#define wp_mem_types 0
+static inline bool wp_mem_page(vaddr_t vpage, paddr_t ppage, int type) { return false; }
+static inline void wp_mem_check(vaddr_t vaddr, paddr_t paddr, int len, int type) {}
+#endif
+
 #define PAGE_SHIFT        12
 #define PAGE_SIZE         (1ul << PAGE_SHIFT)
 #define PAGE_MASK         (PAGE_SIZE - 1)
 
+// --- TLB ---
+#define TLB_SIZE 256
+// flags in the page offset of a tag, above the bits of a misaligned access
+#define TLB_SLOW    0x100 // accessed by the slow path, e.g. MMIO
+#define TLB_INVALID 0x200
+
+// A direct-mapped TLB for each type of access, so that fetching does not
+// evict the pages of data. Entries are tagged with the virtual page and
+// the address space, and refilled by the slow path on a miss.
+typedef struct {
+  vaddr_t tag;   // the virtual page, with TLB_* in the page offset
+  word_t asid;
+  paddr_t paddr; // the physical page
+  uint8_t *host; // host address of the physical page in pmem
+} TLBEntry;
+
+extern TLBEntry tlb[3][TLB_SIZE];
+
+// The fast path only takes aligned accesses to pmem, by one compare of the
+// tag, while the others are taken by vaddr_read() and vaddr_write().
+static inline uint8_t* tlb_hit(vaddr_t addr, int len, int type) {
+  TLBEntry *e = &tlb[type][(addr >> PAGE_SHIFT) % TLB_SIZE];
+  if (likely(e->tag == (addr & (~PAGE_MASK | (len - 1))) && e->asid == isa_mmu_asid())) {
+    return e->host + (addr & PAGE_MASK);
+  }
+  return NULL;
+}
+
+// Accessors of each size, whose fast path has no switch on the size.
+// Misaligned accesses and the ones across pages are taken by the slow path.
+#define VADDR_ACCESSOR(bits) \
+  static inline uint##bits##_t vaddr_read_u##bits(vaddr_t addr) { \
+    uint8_t *host = tlb_hit(addr, bits / 8, MEM_TYPE_READ); \
+    return likely(host != NULL) ? host_read_u##bits(host) : vaddr_read(addr, bits / 8); \
+  } \
+  static inline void vaddr_write_u##bits(vaddr_t addr, uint##bits##_t data) { \
+    uint8_t *host = tlb_hit(addr, bits / 8, MEM_TYPE_WRITE); \
+    if (likely(host != NULL)) host_write_u##bits(host, data); \
+    else vaddr_write(addr, bits / 8, data); \
+  }
+
+VADDR_ACCESSOR(8)
+VADDR_ACCESSOR(16)
+VADDR_ACCESSOR(32)
+IFDEF(CONFIG_ISA64, VADDR_ACCESSOR(64))
+
+// for callers which only know the size at runtime
+static inline word_t vaddr_load(vaddr_t addr, int len) {
+  uint8_t *host = tlb_hit(addr, len, MEM_TYPE_READ);
+  return likely(host != NULL) ? host_read(host, len) : vaddr_read(addr, len);
+}
+
+static inline void vaddr_store(vaddr_t addr, int len, word_t data) {
+  uint8_t *host = tlb_hit(addr, len, MEM_TYPE_WRITE);
+  if (likely(host != NULL)) host_write(host, len, data);
+  else vaddr_write(addr, len, data);
+}
+
 #endif
@@ -16,6 +16,9 @@
 #include <cpu/cpu.h>
 #include <cpu/decode.h>
 #include <cpu/difftest.h>
+#include <cpu/jit.h>
+#include <cpu/aot.h>
+#include <memory/vaddr.h>
 #include <locale.h>
 
 /* The assembly code of instructions executed is only output to the screen
@@ -31,28 +34,40 @@ static uint64_t g_timer = 0; // unit: us
 static bool g_print_step = false;
 
 void device_update();
+uint64_t device_budget();
+void device_idle(bool intr);
 bool wp_test();
+bool wp_active();
+void wp_mem_enable(bool enable);
 
-static void trace_and_difftest(Decode *_this, vaddr_t dnpc) {
-#ifdef CONFIG_ITRACE_COND
-  if (ITRACE_COND) { log_write("%s\n", _this->logbuf); }
-#endif
-  if (g_print_step) { IFDEF(CONFIG_ITRACE, puts(_this->logbuf)); }
-  IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, dnpc));
-#ifdef  CONFIG_WATCHPOINT
-  if(wp_test()) {
-    nemu_state.state = NEMU_STOP;
-    printf("The program hits the watchpoints!\n");
+// Instrumentation enabled at runtime, among the ones compiled in. Each run
+// of instructions checks it once, and takes the loop without any check if
+// nothing is enabled.
+static int g_instr = MUXDEF(CONFIG_DIFFTEST, INSTR_DIFFTEST, 0) |
+  MUXDEF(CONFIG_WATCHPOINT, INSTR_WATCHPOINT, 0);
+
+bool cpu_instrument(int what, bool enable) {
+  const int supported = MUXDEF(CONFIG_ITRACE, INSTR_ITRACE, 0) |
+    MUXDEF(CONFIG_DIFFTEST, INSTR_DIFFTEST, 0) | MUXDEF(CONFIG_WATCHPOINT, INSTR_WATCHPOINT, 0);
+  if ((what & supported) != what) return false;
+  if ((what & INSTR_DIFFTEST) && enable != !!(g_instr & INSTR_DIFFTEST)) {
+    // REF is synchronized with the state of NEMU when it is attached again
+    if (enable) difftest_attach();
+    else difftest_detach();
   }
-#endif
+  IFDEF(CONFIG_WATCHPOINT, if (what & INSTR_WATCHPOINT) wp_mem_enable(enable));
+  g_instr = (enable ? g_instr | what : g_instr & ~what);
+  return true;
+}
+
+static inline bool instrumented() {
+  return g_print_step || (g_instr & (INSTR_ITRACE | INSTR_DIFFTEST)) ||
+    ((g_instr & INSTR_WATCHPOINT) && wp_active());
 }
 
-static void exec_once(Decode *s, vaddr_t pc) {
-  s->pc = pc;
-  s->snpc = pc;
-  isa_exec_once(s);
-  cpu.pc = s->dnpc;
 #ifdef CONFIG_ITRACE
+// fill the log of the instruction executed
+static void itrace(Decode *s) {
   char *p = s->logbuf;
   p += snprintf(p, sizeof(s->logbuf), FMT_WORD ":", s->pc);
   int ilen = s->snpc - s->pc;
@@ -75,15 +90,150 @@ static void exec_once(Decode *s, vaddr_t pc) {
 #else
   p[0] = '\0'; // the upstream llvm does not support loongarch32r
 #endif
+}
+#endif
+
+static void trace_and_difftest(Decode *_this, vaddr_t dnpc) {
+#ifdef CONFIG_ITRACE
+  if ((g_instr & INSTR_ITRACE) || g_print_step) itrace(_this);
+#ifdef CONFIG_ITRACE_COND
+  if ((g_instr & INSTR_ITRACE) && ITRACE_COND) { log_write("%s\n", _this->logbuf); }
+#endif
+  if (g_print_step) { puts(_this->logbuf); }
+#endif
+  if (g_instr & INSTR_DIFFTEST) difftest_step(_this->pc, dnpc);
+#ifdef  CONFIG_WATCHPOINT
+  if((g_instr & INSTR_WATCHPOINT) && wp_test()) {
+    nemu_state.state = NEMU_STOP;
+    printf("The program hits the watchpoints!\n");
+  }
+#endif
+}
+
+static void exec_once(Decode *s, vaddr_t pc) {
+  s->pc = pc;
+  s->snpc = pc;
+  IFDEF(CONFIG_DCACHE, s->de = dcache_lookup(pc));
+  isa_exec_once(s);
+  cpu.pc = s->dnpc;
+}
+
+// Instructions left in the current run of the interpreter. Events which
+// should be handled between instructions end the run by cpu_end_run(), so
+// that the loop without checks only counts instructions.
+static uint64_t g_run_budget = 0, g_run_left = 0;
+// whether the instructions of the current run are only counted at its end
+static bool g_run_deferred = false;
+// engines running blocks end the run after the current block
+static bool g_run_ended = false;
+
+void cpu_end_run() {
+  g_run_budget -= g_run_left;
+  g_run_left = 0;
+  g_run_ended = true;
+}
+
+uint64_t cpu_icount() {
+  // the instruction being run is not counted
+  return g_nr_guest_inst + (g_run_deferred ? g_run_budget - g_run_left - 1 : 0);
+}
+
+#ifdef CONFIG_ENGINE_THREADED
+static uint64_t g_nr_block = 0;
+
+static uint64_t run(Decode *s, uint64_t budget) {
+  // fall back to one instruction per block if each of them should be checked
+  bool step = instrumented();
+  uint64_t left = budget;
+  g_run_ended = false;
+  while (left > 0 && !g_run_ended) {
+    uint64_t nr = s->nr_left = (step ? 1 : left);
+    exec_once(s, cpu.pc);
+    nr -= s->nr_left;
+    left -= nr;
+    g_nr_guest_inst += nr;
+    g_nr_block ++;
+    trace_and_difftest(s, cpu.pc);
+    if (nemu_state.state != NEMU_RUNNING) break;
+  }
+  return budget - left;
+}
+#elif defined(CONFIG_ENGINE_JIT) || defined(CONFIG_ENGINE_AOT)
+// The JIT only tries blocks at the targets of control transfers, also
+// across runs. Translated code of AOT is looked up at any pc.
+static bool g_head = true;
+#define native_exec MUXDEF(CONFIG_ENGINE_JIT, jit_exec, aot_exec)
+
+static uint64_t run(Decode *s, uint64_t budget) {
+  // translated blocks are not run if each instruction should be checked,
+  // while difftest checks each block. Translated code accesses pmem
+  // directly instead of through the TLB, so that watched data are only
+  // checked by the interpreter.
+  bool native = !g_print_step && !(g_instr & INSTR_ITRACE) &&
+    !((g_instr & INSTR_WATCHPOINT) && wp_active()) && wp_mem_types == 0;
+  uint64_t left = budget;
+  g_run_ended = false;
+  while (left > 0 && !g_run_ended) {
+    if (native && (g_head || ISDEF(CONFIG_ENGINE_AOT))) {
+      IFDEF(CONFIG_DIFFTEST, vaddr_t pc = cpu.pc);
+      uint64_t nr = native_exec(left);
+      if (nr > 0) {
+        left -= nr;
+        g_nr_guest_inst += nr;
+        IFDEF(CONFIG_DIFFTEST, if (g_instr & INSTR_DIFFTEST) difftest_step_block(pc, cpu.pc, nr));
+        if (nemu_state.state != NEMU_RUNNING) break;
+        continue;
+      }
+    }
+    exec_once(s, cpu.pc);
+    left --;
+    g_nr_guest_inst ++;
+    trace_and_difftest(s, cpu.pc);
+    if (nemu_state.state != NEMU_RUNNING) break;
+    g_head = (s->dnpc != s->snpc);
+  }
+  return budget - left;
+}
+#else
+static uint64_t run(Decode *s, uint64_t budget) {
+  g_run_budget = g_run_left = budget;
+  if (instrumented()) {
+    while (g_run_left > 0) {
+      g_run_left --;
+      exec_once(s, cpu.pc);
+      g_nr_guest_inst ++;
+      trace_and_difftest(s, cpu.pc);
+      if (nemu_state.state != NEMU_RUNNING) cpu_end_run();
+    }
+    return g_run_budget;
+  }
+
+  g_run_deferred = true;
+  while (g_run_left > 0) {
+    g_run_left --;
+    exec_once(s, cpu.pc);
+  }
+  g_run_deferred = false;
+  g_nr_guest_inst += g_run_budget;
+  return g_run_budget;
+}
 #endif
+
+void cpu_idle() {
+  IFDEF(CONFIG_DEVICE_IDLE, device_idle(true));
 }
 
+// Devices are updated between runs of instructions, whose budget is the
+// number of instructions before the next update.
 static void execute(uint64_t n) {
   Decode s;
-  for (;n > 0; n --) {
-    exec_once(&s, cpu.pc);
-    g_nr_guest_inst ++;
-    trace_and_difftest(&s, cpu.pc);
+  while (n > 0) {
+    uint64_t budget = n;
+#ifdef CONFIG_DEVICE
+    uint64_t nr_device = device_budget();
+    if (nr_device < budget) budget = nr_device;
+#endif
+    n -= run(&s, budget);
     if (nemu_state.state != NEMU_RUNNING) break;
     IFDEF(CONFIG_DEVICE, device_update());
   }
@@ -91,11 +241,18 @@ static void execute(uint64_t n) {
 
 static void statistic() {
   IFNDEF(CONFIG_TARGET_AM, setlocale(LC_NUMERIC, ""));
-#define NUMBERIC_FMT MUXDEF(CONFIG_TARGET_AM, "%", "%'") PRIu64
   Log("host time spent = " NUMBERIC_FMT " us", g_timer);
   Log("total guest instructions = " NUMBERIC_FMT, g_nr_guest_inst);
   if (g_timer > 0) Log("simulation frequency = " NUMBERIC_FMT " inst/s", g_nr_guest_inst * 1000000 / g_timer);
   else Log("Finish running in less than 1 us and can not calculate the simulation frequency");
+  IFDEF(CONFIG_DCACHE, dcache_statistic());
+  IFDEF(CONFIG_TCACHE, tcache_statistic());
+  IFDEF(CONFIG_ENGINE_JIT, jit_statistic());
+  IFDEF(CONFIG_ENGINE_AOT, aot_statistic());
+#ifdef CONFIG_ENGINE_THREADED
+  if (g_nr_block > 0) Log("blocks executed = " NUMBERIC_FMT ", guest instructions per block = %.2f",
+      g_nr_block, (double)g_nr_guest_inst / g_nr_block);
+#endif
 }
 
 void assert_fail_msg() {
@@ -0,0 +1,153 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/decode.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <cpu/jit.h>
+#include <cpu/aot.h>
+
+#ifdef CONFIG_DCACHE
+
+#define NR_DPAGE (CONFIG_MSIZE / PAGE_SIZE)
+#define DPAGE_SIZE (PAGE_SIZE / DCACHE_ALIGN)
+
+// Decoded instructions of each page of pmem, allocated when the page is
+// first executed. Instructions of a page are contiguous, so that a block
+// is simply a run of entries. One more entry is allocated as a sentinel
+// which is never decoded, to stop a block at the end of the page.
+static DecodeEntry *dpage[NR_DPAGE] = {};
+// Decoded instructions in each page. Only stores to pages with some of
+// them are taken by the slow path to invalidate them, so that a page whose
+// instructions are all overwritten, e.g. by a loader, is written as data.
+static uint16_t nr_live[NR_DPAGE] = {};
+// used for instructions which can not be cached, with its sentinel
+static DecodeEntry dcache_bypass[2] = {};
+static uint64_t nr_hit = 0, nr_miss = 0, nr_bypass = 0, nr_invalidate = 0, nr_code_write = 0;
+
+static inline DecodeEntry** dpage_of(paddr_t addr) {
+  return &dpage[(addr - CONFIG_MBASE) / PAGE_SIZE];
+}
+
+static inline uint16_t* live_of(paddr_t addr) {
+  return &nr_live[(addr - CONFIG_MBASE) / PAGE_SIZE];
+}
+
+// the first decoded instruction of a page turns stores to it to the slow path
+static inline void live_add(paddr_t page, int n) {
+  uint16_t *live = live_of(page);
+  if (*live == 0 && n > 0) tlb_flush_write(page);
+  *live += n;
+}
+
+void dcache_decoded(DecodeEntry *e) {
+  if (e == dcache_bypass || e->decode_only) return;
+  live_add(ROUNDDOWN(e->pc, PAGE_SIZE), 1);
+}
+
+static inline DecodeEntry* dcache_reset(DecodeEntry *e, vaddr_t pc) {
+  *e = (DecodeEntry) { .pc = pc };
+  return e;
+}
+
+DecodeEntry* dcache_lookup(vaddr_t pc) {
+  // The cache is indexed and invalidated by physical address, so only
+  // aligned instructions fetched from pmem without translation are cached.
+  if (unlikely(pc % DCACHE_ALIGN != 0 || !in_pmem(pc) ||
+        isa_mmu_check(pc, DCACHE_ALIGN, MEM_TYPE_IFETCH) != MMU_DIRECT)) {
+    nr_bypass ++;
+    return dcache_reset(dcache_bypass, pc);
+  }
+  DecodeEntry **p = dpage_of(pc);
+  if (unlikely(*p == NULL)) {
+    // pages with watched instructions are fetched by each execution
+    paddr_t page = ROUNDDOWN(pc, PAGE_SIZE);
+    if (unlikely(wp_mem_types & (1 << MEM_TYPE_IFETCH)) && wp_mem_page(page, page, MEM_TYPE_IFETCH)) {
+      nr_bypass ++;
+      return dcache_reset(dcache_bypass, pc);
+    }
+    *p = calloc(DPAGE_SIZE + 1, sizeof(DecodeEntry));
+    assert(*p);
+#ifdef CONFIG_TCACHE
+    tcache_load(page, *p);
+    int n = 0;
+    for (int i = 0; i < DPAGE_SIZE; i ++) n += ((*p)[i].handler != NULL);
+    live_add(page, n);
+#endif
+  }
+  DecodeEntry *e = *p + (pc % PAGE_SIZE) / DCACHE_ALIGN;
+  if (likely(e->handler != NULL)) {
+    nr_hit ++;
+    return e;
+  }
+  nr_miss ++;
+  return dcache_reset(e, pc);
+}
+
+void dcache_invalidate(paddr_t addr, int len) {
+  // translated code is built from decoded instructions
+  IFDEF(CONFIG_ENGINE_JIT, jit_invalidate(addr, len));
+  IFDEF(CONFIG_ENGINE_AOT, aot_invalidate(addr, len));
+  paddr_t pc = ROUNDDOWN(addr, DCACHE_ALIGN);
+  bool code = false;
+  for (; pc < addr + len; pc += DCACHE_ALIGN) {
+    uint16_t *live = live_of(pc);
+    if (likely(*live == 0)) continue;
+    DecodeEntry *e = *dpage_of(pc) + (pc % PAGE_SIZE) / DCACHE_ALIGN;
+    if (e->handler != NULL) {
+      e->handler = NULL;
+      nr_invalidate ++;
+      code = true;
+      // stores to the page can be taken by the fast path again
+      if (-- *live == 0) tlb_flush_write(ROUNDDOWN(pc, PAGE_SIZE));
+    }
+  }
+  nr_code_write += code;
+}
+
+void dcache_flush() {
+  IFDEF(CONFIG_ENGINE_JIT, jit_flush());
+  for (int i = 0; i < NR_DPAGE; i ++) {
+    free(dpage[i]);
+    dpage[i] = NULL;
+  }
+  memset(nr_live, 0, sizeof(nr_live));
+  // stores to the pages can be taken by the fast path again
+  tlb_flush();
+}
+
+// A page of pmem has decoded instructions if its entry is not NULL. The
+// entries are indexed by (paddr - CONFIG_MBASE) / PAGE_SIZE.
+DecodeEntry** dcache_page_table() {
+  return dpage;
+}
+
+// Decoded instructions in each page of pmem, indexed as above. Stores to
+// a page without them can not hit decoded or translated instructions.
+const uint16_t* dcache_live_table() {
+  return nr_live;
+}
+
+bool dcache_page_cached(paddr_t page) {
+  return *live_of(page) > 0 || MUXDEF(CONFIG_ENGINE_AOT, aot_page_translated(page), false);
+}
+
+void dcache_statistic() {
+  Log("decode cache: hit = " NUMBERIC_FMT ", miss = " NUMBERIC_FMT
+      ", bypass = " NUMBERIC_FMT ", invalidation = " NUMBERIC_FMT ", writes to code = " NUMBERIC_FMT,
+      nr_hit, nr_miss, nr_bypass, nr_invalidate, nr_code_write);
+}
+#endif
@@ -18,6 +18,7 @@
 #include <isa.h>
 #include <cpu/cpu.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 #include <utils.h>
 #include <difftest-def.h>
 
@@ -127,6 +128,46 @@ void difftest_step(vaddr_t pc, vaddr_t npc) {
 
   checkregs(&ref_r, pc);
 }
+
+// Check after a block of `n' instructions starting at `pc' is executed.
+// An instruction which lets REF skip should be executed as a block alone.
+void difftest_step_block(vaddr_t pc, vaddr_t npc, uint64_t n) {
+  if (n == 1 || is_skip_ref || skip_dut_nr_inst > 0) {
+    difftest_step(pc, npc);
+    return;
+  }
+
+  CPU_state ref_r;
+  ref_difftest_exec(n);
+  ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
+
+  checkregs(&ref_r, pc);
+}
+
+// REF does not run while difftest is detached, and all the state of NEMU
+// is copied to REF when it is attached again.
+// REF is synchronized with the pages written while it is detached.
+void difftest_detach() {
+  is_skip_ref = false;
+  skip_dut_nr_inst = 0;
+  paddr_dirty_fetch_clear(NULL);
+}
+
+void difftest_attach() {
+  static uint64_t dirty[PMEM_DIRTY_WORDS];
+  is_skip_ref = false;
+  skip_dut_nr_inst = 0;
+  paddr_dirty_fetch_clear(dirty);
+  for (uint32_t i = 0; i < PMEM_NR_PAGE; ) {
+    if (!(dirty[i / 64] >> (i % 64) & 1)) { i ++; continue; }
+    uint32_t j = i;
+    while (j < PMEM_NR_PAGE && (dirty[j / 64] >> (j % 64) & 1)) j ++;
+    paddr_t addr = CONFIG_MBASE + i * PAGE_SIZE;
+    ref_difftest_memcpy(addr, guest_to_host(addr), (j - i) * PAGE_SIZE, DIFFTEST_TO_REF);
+    i = j;
+  }
+  ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+}
 #else
 void init_difftest(char *ref_so_file, long img_size, int port) { }
 #endif
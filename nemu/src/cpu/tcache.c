@@ -0,0 +1,252 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <isa.h>
+#include <cpu/decode.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+#ifdef CONFIG_TCACHE
+
+#define NR_DPAGE (CONFIG_MSIZE / PAGE_SIZE)
+#define DPAGE_SIZE (PAGE_SIZE / DCACHE_ALIGN)
+#define TCACHE_MAGIC 0x31656863616374ull
+#define NR_SAMPLE 1024
+
+// The decoded instructions of a page are kept in DIR/<page>/<code>.dc,
+// where <code> is the hash of the instructions decoded. A file is loaded
+// when all of its instructions are found in the memory, so that it stays
+// valid when only the data around them differs.
+typedef struct {
+  uint64_t magic;
+  uint64_t binary; // the build of NEMU which decoded the instructions
+  uint64_t code;   // hash of the instructions
+  uint32_t nr;     // entries following the header
+} TcacheHeader;
+
+// Pointers into NEMU are kept as offsets, since NEMU may be loaded at a
+// different address by each run.
+typedef struct {
+  uint16_t idx; // index of the instruction in the page
+  uint8_t ilen, rd, rs1, rs2;
+  uint32_t inst;
+  uint64_t imm;
+  int64_t handler, name;
+} TcacheEntry;
+
+static const char *tcache_dir = NULL;
+static uint64_t binary = 0;
+static uint64_t *loaded = NULL;    // hash of the file loaded for each page, 0 if none
+static vaddr_t sample[NR_SAMPLE] = {}; // instructions loaded, to measure their decoding
+static int nr_sample = 0;
+static uint64_t nr_page_hit = 0, nr_page_miss = 0, nr_inst_loaded = 0, load_time = 0;
+
+static uint64_t fnv1a(uint64_t h, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  for (size_t i = 0; i < len; i ++) h = (h ^ p[i]) * 0x100000001b3ull;
+  return h;
+}
+
+static inline intptr_t anchor() {
+  return (intptr_t)isa_exec_once;
+}
+
+static inline void page_dir(char *path, paddr_t page) {
+  snprintf(path, PATH_MAX / 2, "%s/" FMT_PADDR, tcache_dir, page);
+}
+
+static void tcache_save();
+
+void tcache_init(const char *dir) {
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    printf("Can not create %s, decoded instructions are not kept\n", dir);
+    return;
+  }
+  tcache_dir = dir;
+  binary = 0xcbf29ce484222325ull;
+  struct stat st;
+  if (stat("/proc/self/exe", &st) == 0) {
+    binary = fnv1a(binary, &st.st_size, sizeof(st.st_size));
+    binary = fnv1a(binary, &st.st_mtime, sizeof(st.st_mtime));
+  }
+  loaded = calloc(NR_DPAGE, sizeof(*loaded));
+  assert(loaded);
+  atexit(tcache_save);
+}
+
+// Check that a mapped file is decoded by this build, and that all of its
+// instructions are in the memory.
+static bool match(paddr_t page, const void *map, size_t size) {
+  const TcacheHeader *h = map;
+  const TcacheEntry *e = (const void *)(h + 1);
+  if (size < sizeof(*h) || h->magic != TCACHE_MAGIC || h->binary != binary ||
+      h->nr > DPAGE_SIZE || sizeof(*h) + h->nr * sizeof(*e) > size) return false;
+  for (int k = 0; k < h->nr; k ++) {
+    if (e[k].idx >= DPAGE_SIZE || e[k].ilen == 0 || e[k].ilen > DCACHE_ALIGN) return false;
+    if (memcmp(guest_to_host(page + e[k].idx * DCACHE_ALIGN), &e[k].inst, e[k].ilen) != 0) return false;
+  }
+  return true;
+}
+
+static void fill(paddr_t page, DecodeEntry *entries, const TcacheHeader *h) {
+  const TcacheEntry *e = (const void *)(h + 1);
+  for (int k = 0; k < h->nr; k ++, e ++) {
+    paddr_t pc = page + e->idx * DCACHE_ALIGN;
+    DecodeEntry *de = &entries[e->idx];
+    *de = (DecodeEntry) {
+      .pc = pc, .handler = (const void *)(anchor() + e->handler), .inst = e->inst,
+      .ilen = e->ilen, .rd = e->rd, .rs1 = e->rs1, .rs2 = e->rs2, .imm = e->imm,
+    };
+    IFDEF(CONFIG_INSTPAT_NAME, de->name = (const char *)(anchor() + e->name));
+    if (nr_sample < NR_SAMPLE) sample[nr_sample ++] = pc;
+  }
+}
+
+// Called when a page is first executed, with its entries all empty. The
+// file with the most instructions is loaded among those matched.
+void tcache_load(paddr_t page, DecodeEntry *entries) {
+  if (tcache_dir == NULL) return;
+  uint64_t start = get_time();
+  int i = (page - CONFIG_MBASE) / PAGE_SIZE;
+  loaded[i] = 0;
+  char dir[PATH_MAX / 2], path[PATH_MAX];
+  page_dir(dir, page);
+  DIR *d = opendir(dir);
+  if (d == NULL) { nr_page_miss ++; return; }
+  void *best = NULL;
+  size_t best_size = 0;
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL) {
+    const char *suffix = strrchr(ent->d_name, '.');
+    if (suffix == NULL || strcmp(suffix, ".dc") != 0) continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) continue;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) continue;
+    if (match(page, map, st.st_size) &&
+        (best == NULL || ((TcacheHeader *)map)->nr > ((TcacheHeader *)best)->nr)) {
+      if (best != NULL) munmap(best, best_size);
+      best = map;
+      best_size = st.st_size;
+    } else {
+      munmap(map, st.st_size);
+    }
+  }
+  closedir(d);
+  if (best != NULL) {
+    const TcacheHeader *h = best;
+    fill(page, entries, h);
+    loaded[i] = h->code;
+    nr_inst_loaded += h->nr;
+    munmap(best, best_size);
+    nr_page_hit ++;
+  } else {
+    nr_page_miss ++;
+  }
+  load_time += get_time() - start;
+}
+
+// Each file is renamed from a temporary one when it is complete, so that
+// other runs of NEMU sharing the cache never see a partial one.
+static bool save_page(paddr_t page, const TcacheHeader *h, const TcacheEntry *e) {
+  char dir[PATH_MAX / 2], path[PATH_MAX], tmp[PATH_MAX + 16];
+  page_dir(dir, page);
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) return false;
+  snprintf(path, sizeof(path), "%s/%016" PRIx64 ".dc", dir, h->code);
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+  FILE *fp = fopen(tmp, "wb");
+  if (fp == NULL) return false;
+  bool ok = fwrite(h, sizeof(*h), 1, fp) == 1 && fwrite(e, sizeof(*e), h->nr, fp) == h->nr;
+  ok = (fclose(fp) == 0) && ok;
+  if (!ok || rename(tmp, path) != 0) {
+    remove(tmp);
+    return false;
+  }
+  return true;
+}
+
+static void remove_page(paddr_t page, uint64_t code) {
+  char dir[PATH_MAX / 2], path[PATH_MAX];
+  page_dir(dir, page);
+  snprintf(path, sizeof(path), "%s/%016" PRIx64 ".dc", dir, code);
+  remove(path);
+}
+
+static void tcache_save() {
+  static TcacheEntry buf[DPAGE_SIZE];
+  DecodeEntry **dpage = dcache_page_table();
+  int nr_saved = 0;
+  for (int i = 0; i < NR_DPAGE; i ++) {
+    if (dpage[i] == NULL) continue;
+    TcacheHeader h = { .magic = TCACHE_MAGIC, .binary = binary, .code = 0xcbf29ce484222325ull };
+    for (int k = 0; k < DPAGE_SIZE; k ++) {
+      const DecodeEntry *de = &dpage[i][k];
+      if (de->handler == NULL) continue;
+      TcacheEntry *e = &buf[h.nr ++];
+      *e = (TcacheEntry) {
+        .idx = k, .ilen = de->ilen, .rd = de->rd, .rs1 = de->rs1, .rs2 = de->rs2,
+        .inst = de->inst, .imm = de->imm, .handler = (intptr_t)de->handler - anchor(),
+        .name = MUXDEF(CONFIG_INSTPAT_NAME, (intptr_t)de->name - anchor(), 0),
+      };
+      h.code = fnv1a(h.code, &e->idx, sizeof(e->idx));
+      h.code = fnv1a(h.code, &e->inst, e->ilen);
+    }
+    // nothing is decoded since the page is loaded
+    if (h.nr == 0 || h.code == loaded[i]) continue;
+    if (!save_page(CONFIG_MBASE + i * PAGE_SIZE, &h, buf)) continue;
+    nr_saved ++;
+    // the file loaded is superseded by the one saved
+    if (loaded[i] != 0) remove_page(CONFIG_MBASE + i * PAGE_SIZE, loaded[i]);
+  }
+  if (nr_saved > 0) Log("tcache: saved decoded instructions of %d pages to %s", nr_saved, tcache_dir);
+}
+
+void tcache_statistic() {
+  if (tcache_dir == NULL) return;
+  Log("tcache: pages loaded = " NUMBERIC_FMT ", not cached = " NUMBERIC_FMT
+      ", instructions loaded = " NUMBERIC_FMT,
+      nr_page_hit, nr_page_miss, nr_inst_loaded);
+  if (nr_sample == 0) return;
+
+  // the time saved is estimated by decoding some of the loaded instructions again
+  const int repeat = 8;
+  uint64_t start = get_time();
+  for (int r = 0; r < repeat; r ++) {
+    for (int k = 0; k < nr_sample; k ++) {
+      DecodeEntry de = { .pc = sample[k], .decode_only = true };
+      Decode s = { .pc = sample[k], .snpc = sample[k], .de = &de };
+      isa_exec_once(&s);
+    }
+  }
+  uint64_t decode_time = (get_time() - start) * nr_inst_loaded / ((uint64_t)nr_sample * repeat);
+  Log("tcache: loaded in " NUMBERIC_FMT " us, which takes about " NUMBERIC_FMT
+      " us to decode, saving " NUMBERIC_FMT " us",
+      load_time, decode_time, (decode_time > load_time ? decode_time - load_time : 0));
+}
+#endif
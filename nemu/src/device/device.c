@@ -15,9 +15,11 @@
 
 #include <common.h>
 #include <utils.h>
-#include <device/alarm.h>
+#include <device/event.h>
+#include <cpu/cpu.h>
 #ifndef CONFIG_TARGET_AM
 #include <SDL2/SDL.h>
+#include <unistd.h>
 #endif
 
 void init_map();
@@ -28,22 +30,102 @@ void init_i8042();
 void init_audio();
 void init_disk();
 void init_sdcard();
-void init_alarm();
 
 void send_key(uint8_t, bool);
 void vga_update_screen();
 
-void device_update() {
-  static uint64_t last = 0;
-  uint64_t now = get_time();
-  if (now - last < 1000000 / TIMER_HZ) {
-    return;
+#define UPDATE_INTERVAL (1000000 / TIMER_HZ) // unit: us
+// at least this many instructions are run between two checks of time
+#define MIN_BUDGET 256
+// the longest sleep of an idle guest, which may wait for the RTC
+#define IDLE_SLICE 1000 // unit: us
+
+static uint64_t last = 0;  // time of the last estimation of the speed
+static uint64_t last_nr_inst = 0;
+static uint64_t nr_inst_per_interval = 65536;
+// with icount, each instruction takes 2^icount_shift ns of virtual time
+static int icount_shift = -1;
+static uint64_t idle_skip = 0; // time skipped by idle guests with icount
+static uint64_t idle_sleep = 0; // time slept in the current interval
+static bool idle = false; // whether the guest was idle in the last run
+
+void device_set_icount(int shift) {
+  Assert(shift >= 0 && shift < 30, "icount shift should be in [0, 30)");
+  icount_shift = shift;
+}
+
+// The virtual time in us, which follows the host time, or the number of
+// instructions with icount, so that runs are reproducible.
+uint64_t device_time() {
+  if (icount_shift >= 0) {
+    // icount * 2^shift / 1000, which does not overflow
+    uint64_t icount = cpu_icount();
+    return ((icount / 1000) << icount_shift) + (((icount % 1000) << icount_shift) / 1000) + idle_skip;
   }
-  last = now;
+  return get_time();
+}
 
-  IFDEF(CONFIG_HAS_VGA, vga_update_screen());
+#ifdef CONFIG_DEVICE_IDLE
+// The guest waits for the time to pass, which is skipped to the next event
+// with icount, or slept away. A guest waiting for an interrupt sleeps until
+// the next event, while one polling the RTC may wait for a time without
+// any event, and sleeps at most IDLE_SLICE at a time.
+void device_idle(bool intr) {
+  uint64_t now = device_time(), next = event_next();
+  if (next <= now) return;
+  if (icount_shift >= 0) {
+    if (next != UINT64_MAX) idle_skip += next - now;
+  } else {
+#ifndef CONFIG_TARGET_AM
+    uint64_t us = (intr || next - now < IDLE_SLICE ? next - now : IDLE_SLICE);
+    if (us > UPDATE_INTERVAL) us = UPDATE_INTERVAL;
+    usleep(us);
+    idle_sleep += us;
+#endif
+  }
+  idle = true;
+  cpu_end_run();
+}
+#endif
+
+// The number of instructions which can run before the next event, which
+// is estimated from the speed in the last interval, or exact with icount.
+// The CPU runs them without checking the time.
+uint64_t device_budget() {
+  uint64_t now = event_now(), next = event_next();
+  if (icount_shift >= 0) {
+    if (next == UINT64_MAX) return UINT64_MAX;
+    uint64_t deadline = ((next - idle_skip) * 1000 + (1ull << icount_shift) - 1) >> icount_shift;
+    uint64_t icount = cpu_icount();
+    return (deadline > icount ? deadline - icount : 1);
+  }
+  // an idle guest is checked again soon, instead of spinning until the event
+  if (idle) {
+    idle = false;
+    return MIN_BUDGET;
+  }
+  uint64_t wait = (next - now < UPDATE_INTERVAL ? next - now : UPDATE_INTERVAL);
+  uint64_t budget = nr_inst_per_interval * wait / UPDATE_INTERVAL;
+  return (budget < MIN_BUDGET ? MIN_BUDGET : budget);
+}
+
+// Events due are run between runs of instructions.
+void device_update() {
+  uint64_t now = device_time();
+  if (icount_shift < 0 && now - last >= UPDATE_INTERVAL) {
+    extern uint64_t g_nr_guest_inst;
+    // the time slept by the guest is not the speed of running it
+    uint64_t busy = (now - last > idle_sleep ? now - last - idle_sleep : 1);
+    nr_inst_per_interval = (g_nr_guest_inst - last_nr_inst) * UPDATE_INTERVAL / busy;
+    last_nr_inst = g_nr_guest_inst;
+    last = now;
+    idle_sleep = 0;
+  }
+  event_run(now);
+}
 
 #ifndef CONFIG_TARGET_AM
+static void poll_sdl_event() {
   SDL_Event event;
   while (SDL_PollEvent(&event)) {
     switch (event.type) {
@@ -63,8 +145,8 @@ void device_update() {
       default: break;
     }
   }
-#endif
 }
+#endif
 
 void sdl_clear_event_queue() {
 #ifndef CONFIG_TARGET_AM
@@ -85,5 +167,6 @@ void init_device() {
   IFDEF(CONFIG_HAS_DISK, init_disk());
   IFDEF(CONFIG_HAS_SDCARD, init_sdcard());
 
-  IFNDEF(CONFIG_TARGET_AM, init_alarm());
+  IFDEF(CONFIG_HAS_VGA, event_add("vga", UPDATE_INTERVAL, UPDATE_INTERVAL, vga_update_screen));
+  IFNDEF(CONFIG_TARGET_AM, event_add("sdl", UPDATE_INTERVAL, UPDATE_INTERVAL, poll_sdl_event));
 }
@@ -0,0 +1,83 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#include <device/event.h>
+
+typedef struct {
+  uint64_t deadline, period;
+  event_handler_t handler;
+  const char *name;
+} Event;
+
+// a min-heap of the deadlines
+static Event *heap = NULL;
+static int nr_event = 0, capacity = 0;
+static uint64_t now = 0;
+
+static inline void swap(int i, int j) {
+  Event t = heap[i];
+  heap[i] = heap[j];
+  heap[j] = t;
+}
+
+static void sift_up(int i) {
+  for (; i > 0 && heap[(i - 1) / 2].deadline > heap[i].deadline; i = (i - 1) / 2) swap(i, (i - 1) / 2);
+}
+
+static void sift_down(int i) {
+  while (true) {
+    int min = i, l = 2 * i + 1, r = 2 * i + 2;
+    if (l < nr_event && heap[l].deadline < heap[min].deadline) min = l;
+    if (r < nr_event && heap[r].deadline < heap[min].deadline) min = r;
+    if (min == i) return;
+    swap(i, min);
+    i = min;
+  }
+}
+
+void event_add(const char *name, uint64_t delay, uint64_t period, event_handler_t h) {
+  if (nr_event == capacity) {
+    capacity = (capacity == 0 ? 8 : capacity * 2);
+    heap = realloc(heap, sizeof(Event) * capacity);
+    assert(heap);
+  }
+  heap[nr_event] = (Event) { .deadline = now + delay, .period = period, .handler = h, .name = name };
+  sift_up(nr_event ++);
+}
+
+uint64_t event_now() {
+  return now;
+}
+
+uint64_t event_next() {
+  return (nr_event == 0 ? UINT64_MAX : heap[0].deadline);
+}
+
+void event_run(uint64_t t) {
+  now = t;
+  while (nr_event > 0 && heap[0].deadline <= now) {
+    Event e = heap[0];
+    if (e.period != 0) {
+      // ticks missed when the host is slow are dropped
+      heap[0].deadline += e.period;
+      if (heap[0].deadline <= now) heap[0].deadline = now + e.period;
+    } else {
+      heap[0] = heap[-- nr_event];
+    }
+    sift_down(0);
+    e.handler();
+  }
+}
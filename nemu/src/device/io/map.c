@@ -46,6 +46,55 @@ static void invoke_callback(io_callback_t c, paddr_t offset, int len, bool is_wr
   if (c != NULL) { c(offset, len, is_write); }
 }
 
+#define IO_NR_PTE (1 << (IO_DIR_SHIFT - IO_PAGE_SHIFT))
+#define IO_PAGE_SIZE (1ull << IO_PAGE_SHIFT)
+
+static uintptr_t* io_pte(IOTable *t, uint32_t addr, bool alloc) {
+  uintptr_t **pt = &t->dir[addr >> IO_DIR_SHIFT];
+  if (*pt == NULL) {
+    if (!alloc) return NULL;
+    *pt = calloc(IO_NR_PTE, sizeof(uintptr_t));
+    assert(*pt);
+  }
+  return &(*pt)[(addr >> IO_PAGE_SHIFT) % IO_NR_PTE];
+}
+
+// Check the pages covered by the map if fill is false, otherwise point
+// them to the map.
+static IOMap* io_table_walk(IOTable *t, IOMap *map, bool fill) {
+  for (uint64_t a = map->low, next; a <= map->high; a = next) {
+    next = (a & ~(IO_PAGE_SIZE - 1)) + IO_PAGE_SIZE;
+    uint64_t end = (map->high < next - 1 ? map->high : next - 1);
+    uintptr_t *pte = io_pte(t, a, fill);
+    if (!fill) {
+      if (pte == NULL || *pte == 0) continue;
+      if (!(*pte & IO_SHARED)) return (IOMap *)*pte;
+      uintptr_t *bytes = (uintptr_t *)(*pte & ~IO_SHARED);
+      for (uint64_t b = a; b <= end; b ++) {
+        if (bytes[b % IO_PAGE_SIZE] != 0) return (IOMap *)bytes[b % IO_PAGE_SIZE];
+      }
+      continue;
+    }
+    if (a + IO_PAGE_SIZE == next && end == next - 1) { *pte = (uintptr_t)map; continue; }
+    if (*pte == 0) {
+      uintptr_t *bytes = calloc(IO_PAGE_SIZE, sizeof(uintptr_t));
+      assert(bytes);
+      *pte = (uintptr_t)bytes | IO_SHARED;
+    }
+    uintptr_t *bytes = (uintptr_t *)(*pte & ~IO_SHARED);
+    for (uint64_t b = a; b <= end; b ++) bytes[b % IO_PAGE_SIZE] = (uintptr_t)map;
+  }
+  return NULL;
+}
+
+IOMap* io_table_add(IOTable *t, IOMap *map) {
+  Assert((uint64_t)map->high < 0x100000000ull && map->low <= map->high,
+      "map %s should be below 4 GiB", map->name);
+  IOMap *old = io_table_walk(t, map, false);
+  if (old == NULL) io_table_walk(t, map, true);
+  return old;
+}
+
 void init_map() {
   io_space = malloc(IO_SPACE_MAX);
   assert(io_space);
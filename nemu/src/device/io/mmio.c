@@ -15,15 +15,14 @@
 
 #include <device/map.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 
-#define NR_MAP 16
-
-static IOMap maps[NR_MAP] = {};
-static int nr_map = 0;
+static IOTable table = {};
 
 static IOMap* fetch_mmio_map(paddr_t addr) {
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  return (mapid == -1 ? NULL : &maps[mapid]);
+  IOMap *map = io_table_find(&table, addr);
+  if (map != NULL) difftest_skip_ref();
+  return map;
 }
 
 static void report_mmio_overlap(const char *name1, paddr_t l1, paddr_t r1,
@@ -34,23 +33,30 @@ static void report_mmio_overlap(const char *name1, paddr_t l1, paddr_t r1,
 
 /* device interface */
 void add_mmio_map(const char *name, paddr_t addr, void *space, uint32_t len, io_callback_t callback) {
-  assert(nr_map < NR_MAP);
   paddr_t left = addr, right = addr + len - 1;
-  if (in_pmem(left) || in_pmem(right)) {
+  if (in_pmem(left) || in_pmem(right) || (left < PMEM_LEFT && right > PMEM_RIGHT)) {
     report_mmio_overlap(name, left, right, "pmem", PMEM_LEFT, PMEM_RIGHT);
   }
-  for (int i = 0; i < nr_map; i++) {
-    if (left <= maps[i].high && right >= maps[i].low) {
-      report_mmio_overlap(name, left, right, maps[i].name, maps[i].low, maps[i].high);
-    }
-  }
+  const MemRegion *r = (region_of(left) ? region_of(left) : region_of(right));
+  if (r != NULL) report_mmio_overlap(name, left, right, r->name, r->base, r->base + r->size - 1);
 
-  maps[nr_map] = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
-    .space = space, .callback = callback };
-  Log("Add mmio map '%s' at [" FMT_PADDR ", " FMT_PADDR "]",
-      maps[nr_map].name, maps[nr_map].low, maps[nr_map].high);
+  IOMap *map = malloc(sizeof(IOMap));
+  assert(map);
+  *map = (IOMap){ .name = name, .low = left, .high = right, .space = space, .callback = callback };
+  IOMap *old = io_table_add(&table, map);
+  if (old != NULL) report_mmio_overlap(name, left, right, old->name, old->low, old->high);
+  Log("Add mmio map '%s' at [" FMT_PADDR ", " FMT_PADDR "]", map->name, map->low, map->high);
+}
 
-  nr_map ++;
+// Maps without callback, e.g. the frame buffer, are plain memory, whose
+// pages are accessed by the fast path of the TLB. Their accesses are not
+// seen by difftest, which should skip them in the REF.
+uint8_t* mmio_to_host(paddr_t addr) {
+  if (ISDEF(CONFIG_DIFFTEST)) return NULL;
+  IOMap *map = io_table_find(&table, addr);
+  paddr_t page = ROUNDDOWN(addr, PAGE_SIZE);
+  if (map == NULL || map->callback != NULL || page < map->low || page + PAGE_SIZE - 1 > map->high) return NULL;
+  return (uint8_t *)map->space + (addr - map->low);
 }
 
 /* bus interface */
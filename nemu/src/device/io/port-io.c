@@ -17,33 +17,37 @@
 
 #define PORT_IO_SPACE_MAX 65535
 
-#define NR_MAP 16
-static IOMap maps[NR_MAP] = {};
-static int nr_map = 0;
+static IOTable table = {};
+
+static IOMap* fetch_pio_map(ioaddr_t addr) {
+  IOMap *map = io_table_find(&table, addr);
+  assert(map != NULL);
+  difftest_skip_ref();
+  return map;
+}
 
 /* device interface */
 void add_pio_map(const char *name, ioaddr_t addr, void *space, uint32_t len, io_callback_t callback) {
-  assert(nr_map < NR_MAP);
   assert(addr + len <= PORT_IO_SPACE_MAX);
-  maps[nr_map] = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
+  IOMap *map = malloc(sizeof(IOMap));
+  assert(map);
+  *map = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
     .space = space, .callback = callback };
-  Log("Add port-io map '%s' at [" FMT_PADDR ", " FMT_PADDR "]",
-      maps[nr_map].name, maps[nr_map].low, maps[nr_map].high);
-
-  nr_map ++;
+  IOMap *old = io_table_add(&table, map);
+  if (old != NULL) {
+    panic("port-io map %s@[" FMT_PADDR ", " FMT_PADDR "] is overlapped with %s@[" FMT_PADDR ", " FMT_PADDR "]",
+        name, map->low, map->high, old->name, old->low, old->high);
+  }
+  Log("Add port-io map '%s' at [" FMT_PADDR ", " FMT_PADDR "]", map->name, map->low, map->high);
 }
 
 /* CPU interface */
 uint32_t pio_read(ioaddr_t addr, int len) {
   assert(addr + len - 1 < PORT_IO_SPACE_MAX);
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  assert(mapid != -1);
-  return map_read(addr, len, &maps[mapid]);
+  return map_read(addr, len, fetch_pio_map(addr));
 }
 
 void pio_write(ioaddr_t addr, int len, uint32_t data) {
   assert(addr + len - 1 < PORT_IO_SPACE_MAX);
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  assert(mapid != -1);
-  map_write(addr, len, data, &maps[mapid]);
+  map_write(addr, len, data, fetch_pio_map(addr));
 }
@@ -14,28 +14,50 @@
 ***************************************************************************************/
 
 #include <device/map.h>
-#include <device/alarm.h>
+#include <device/event.h>
 #include <utils.h>
+#include <cpu/cpu.h>
+#include <isa.h>
 
 static uint32_t *rtc_port_base = NULL;
 
+#ifdef CONFIG_DEVICE_IDLE
+// a guest reading the RTC at the same pc this many times in a row, with
+// at most IDLE_LOOP instructions between the reads, is waiting for the time
+#define IDLE_SPIN 16
+#define IDLE_LOOP 64
+
+static void rtc_check_idle() {
+  static vaddr_t last_pc = 0;
+  static uint64_t last_icount = 0;
+  static int nr_spin = 0;
+  uint64_t icount = cpu_icount();
+  nr_spin = (cpu.pc == last_pc && icount - last_icount <= IDLE_LOOP ? nr_spin + 1 : 0);
+  last_pc = cpu.pc;
+  last_icount = icount;
+  if (nr_spin >= IDLE_SPIN) {
+    nr_spin = 0;
+    device_idle(false);
+  }
+}
+#endif
+
 static void rtc_io_handler(uint32_t offset, int len, bool is_write) {
   assert(offset == 0 || offset == 4);
   if (!is_write && offset == 4) {
-    uint64_t us = get_time();
+    IFDEF(CONFIG_DEVICE_IDLE, rtc_check_idle());
+    uint64_t us = device_time();
     rtc_port_base[0] = (uint32_t)us;
     rtc_port_base[1] = us >> 32;
   }
 }
 
-#ifndef CONFIG_TARGET_AM
 static void timer_intr() {
   if (nemu_state.state == NEMU_RUNNING) {
     extern void dev_raise_intr();
     dev_raise_intr();
   }
 }
-#endif
 
 void init_timer() {
   rtc_port_base = (uint32_t *)new_space(8);
@@ -44,5 +66,5 @@ void init_timer() {
 #else
   add_mmio_map("rtc", CONFIG_RTC_MMIO, rtc_port_base, 8, rtc_io_handler);
 #endif
-  IFNDEF(CONFIG_TARGET_AM, add_alarm_handle(timer_intr));
+  event_add("timer", 1000000 / TIMER_HZ, 1000000 / TIMER_HZ, timer_intr);
 }
@@ -0,0 +1,233 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <isa.h>
+#include <cpu/aot.h>
+#include <cpu/decode.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <utils.h>
+#include "local-include/aot.h"
+
+#define AOT_CC MUXDEF(CONFIG_CC_CLANG, "clang", "gcc")
+
+static const char *aot_dir = CONFIG_AOT_DIR;
+static AotEnv env = {};
+static const AotBlock *blocks = NULL;
+static uint32_t nr_block = 0;
+static const AotBlock **block_at = NULL; // the block starting at each word of the image
+static uint8_t *valid = NULL;
+static uint32_t *code = NULL; // bitmap of the words translated
+static vaddr_t img_base = 0;
+static uint32_t img_words = 0;
+static uint64_t nr_native = 0, nr_enter = 0, nr_invalidate = 0;
+
+void aot_set_dir(const char *dir) {
+  aot_dir = dir;
+}
+
+static uint64_t fnv1a(uint64_t h, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  for (size_t i = 0; i < len; i ++) h = (h ^ p[i]) * 0x100000001b3ull;
+  return h;
+}
+
+// The translation depends on the image, where it is loaded, and the
+// decoder of this build of NEMU.
+static uint64_t image_key(uint32_t size) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  h = fnv1a(h, guest_to_host(RESET_VECTOR), size);
+  uint32_t layout[] = { CONFIG_MBASE, CONFIG_MSIZE, RESET_VECTOR, size };
+  h = fnv1a(h, layout, sizeof(layout));
+  h = fnv1a(h, aot_abi, sizeof(aot_abi));
+  struct stat st;
+  if (stat("/proc/self/exe", &st) == 0) {
+    h = fnv1a(h, &st.st_size, sizeof(st.st_size));
+    h = fnv1a(h, &st.st_mtime, sizeof(st.st_mtime));
+  }
+  return h;
+}
+
+static void* open_so(const char *so, uint64_t key) {
+  void *handle = dlopen(so, RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL) return NULL;
+  const char *abi = dlsym(handle, "aot_abi");
+  const uint64_t *k = dlsym(handle, "aot_key");
+  if (abi == NULL || k == NULL || strcmp(abi, aot_abi) != 0 || *k != key) {
+    dlclose(handle);
+    return NULL;
+  }
+  return handle;
+}
+
+static bool make_dir(const char *dir) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s", dir);
+  for (char *p = path + 1; ; p ++) {
+    if (*p != '/' && *p != '\0') continue;
+    char c = *p;
+    *p = '\0';
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) return false;
+    if (c == '\0') return true;
+    *p = c;
+  }
+}
+
+// Compile `c' into the shared object `so'. The compiler is run without a
+// shell, so the paths are passed as they are.
+static bool compile(const char *so, const char *c) {
+  char *argv[] = { AOT_CC, "-O2", "-fPIC", "-shared", "-o", (char *)so, (char *)c, NULL };
+  pid_t pid = fork();
+  if (pid < 0) return false;
+  if (pid == 0) {
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) return false;
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Translate the image into `name'.so, which is renamed from a temporary
+// file when it is complete, so that other runs of NEMU sharing the cache
+// never see a partial one.
+static bool build(const char *name, uint32_t size, uint64_t key) {
+  if (!make_dir(aot_dir)) return false;
+  char c_tmp[PATH_MAX], so_tmp[PATH_MAX], path[PATH_MAX];
+  snprintf(c_tmp, sizeof(c_tmp), "%s.%d.c", name, getpid());
+  snprintf(so_tmp, sizeof(so_tmp), "%s.%d.so", name, getpid());
+  FILE *fp = fopen(c_tmp, "w");
+  if (fp == NULL) return false;
+  int n = aot_translate(fp, RESET_VECTOR, size, key);
+  fclose(fp);
+  if (!compile(so_tmp, c_tmp)) {
+    remove(c_tmp);
+    remove(so_tmp);
+    return false;
+  }
+  snprintf(path, sizeof(path), "%s.c", name);
+  rename(c_tmp, path);
+  snprintf(path, sizeof(path), "%s.so", name);
+  rename(so_tmp, path);
+  Log("aot: %d blocks translated", n);
+  return true;
+}
+
+static int aot_store(uint32_t addr, int len, uint32_t data) {
+  uint64_t nr = nr_invalidate;
+  vaddr_store(addr, len, data);
+  return nr != nr_invalidate;
+}
+
+void aot_load(long img_size) {
+  uint32_t size = img_size;
+  uint64_t key = image_key(size);
+  // leave room for the suffixes of the files
+  char name[PATH_MAX / 2], so[PATH_MAX];
+  snprintf(name, sizeof(name), "%s/%016" PRIx64, aot_dir, key);
+  snprintf(so, sizeof(so), "%s.so", name);
+
+  uint64_t start = get_time();
+  void *handle = open_so(so, key);
+  if (handle == NULL) {
+    if (build(name, size, key)) handle = open_so(so, key);
+    if (handle == NULL) {
+      Log("aot: can not translate the image into %s, which is run by the interpreter", so);
+      return;
+    }
+    Log("aot: translated the image into %s in %" PRIu64 " ms", so, (get_time() - start) / 1000);
+  } else {
+    Log("aot: loaded the translated image %s", so);
+  }
+
+  blocks = dlsym(handle, "aot_blocks");
+  nr_block = *(const uint32_t *)dlsym(handle, "aot_nr_blocks");
+  img_base = RESET_VECTOR;
+  img_words = size / 4;
+  block_at = calloc(img_words, sizeof(*block_at));
+  valid = malloc(nr_block);
+  code = calloc((img_words + 31) / 32, sizeof(*code));
+  assert(block_at && valid && code);
+  memset(valid, 1, nr_block);
+  for (uint32_t i = 0; i < nr_block; i ++) {
+    const AotBlock *b = &blocks[i];
+    block_at[(b->pc - img_base) / 4] = b;
+    for (uint32_t w = (b->pc - img_base) / 4; w < (b->pc - img_base) / 4 + b->nr_inst; w ++) {
+      code[w / 32] |= 1u << (w % 32);
+    }
+  }
+
+  env = (AotEnv) {
+    .gpr = cpu.gpr, .pc = &cpu.pc, .mem = guest_to_host(CONFIG_MBASE),
+    .live = dcache_live_table(), .code = code, .dirty = paddr_dirty_bitmap(), .valid = valid,
+    .store = aot_store,
+  };
+}
+
+uint64_t aot_exec(uint64_t n) {
+  uint32_t w = (cpu.pc - img_base) / 4;
+  if (block_at == NULL || cpu.pc % 4 != 0 || w >= img_words) return 0;
+  const AotBlock *b = block_at[w];
+  // blocks are indexed and invalidated by physical address as the decode cache
+  if (b == NULL || isa_mmu_check(cpu.pc, 4, MEM_TYPE_IFETCH) != MMU_DIRECT) return 0;
+  env.left = n;
+  b->fn(&env);
+  uint64_t nr = n - env.left;
+  nr_native += nr;
+  nr_enter ++;
+  return nr;
+}
+
+// Blocks with a written instruction are never run again, and the written
+// words are run by the interpreter.
+void aot_invalidate(paddr_t addr, int len) {
+  if (code == NULL) return;
+  for (uint32_t w = (addr - img_base) / 4; w <= (addr + len - 1 - img_base) / 4; w ++) {
+    if (w >= img_words || !(code[w / 32] >> (w % 32) & 1)) continue;
+    code[w / 32] &= ~(1u << (w % 32));
+    uint32_t first = (w >= AOT_MAX_INST - 1 ? w - (AOT_MAX_INST - 1) : 0);
+    for (uint32_t s = first; s <= w; s ++) {
+      const AotBlock *b = block_at[s];
+      if (b != NULL && s + b->nr_inst > w && valid[b - blocks]) {
+        valid[b - blocks] = 0;
+        nr_invalidate ++;
+      }
+    }
+  }
+}
+
+bool aot_page_translated(paddr_t page) {
+  if (code == NULL || page + PAGE_SIZE <= img_base || page >= img_base + img_words * 4) return false;
+  for (paddr_t a = page; a < page + PAGE_SIZE; a += 4) {
+    uint32_t w = (a - img_base) / 4;
+    if (w < img_words && (code[w / 32] >> (w % 32) & 1)) return true;
+  }
+  return false;
+}
+
+void aot_statistic() {
+  if (block_at == NULL) return;
+  Log("aot: translated blocks = %" PRIu32 ", invalidated = " NUMBERIC_FMT
+      ", native instructions = " NUMBERIC_FMT ", returns to the dispatcher = " NUMBERIC_FMT,
+      nr_block, nr_invalidate, nr_native, nr_enter);
+}
@@ -0,0 +1,60 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#ifndef __AOT_AOT_H__
+#define __AOT_AOT_H__
+
+#include <common.h>
+
+#define AOT_MAX_INST 64 // guest instructions per block
+
+// Types shared with the translated code, which is given their definitions
+// as `aot_abi'. A shared object built with other definitions is not used.
+#define AOT_ABI(...) __VA_ARGS__ static const char aot_abi[] = #__VA_ARGS__;
+AOT_ABI(
+typedef struct {
+  uint32_t *gpr;
+  uint32_t *pc;
+  uint8_t *mem;
+  const uint16_t *live;
+  const uint32_t *code;
+  const uint64_t *dirty;
+  const uint8_t *valid;
+  uint64_t left;
+  int (*store)(uint32_t addr, int len, uint32_t data);
+} AotEnv;
+
+typedef struct {
+  uint32_t pc;
+  uint32_t nr_inst;
+  void (*fn)(AotEnv *e);
+} AotBlock;
+)
+
+/* A translated block returns with `pc' and `left' updated, and:
+ *   mem = host address of pmem, live = dcache_live_table()
+ *   code = bitmap of the translated instructions in the image
+ *   dirty = paddr_dirty_bitmap()
+ *   valid = whether each block is still valid, in the order of aot_blocks
+ *   store() = store to pmem which may invalidate translated code, and
+ *     returns true if it does
+ */
+
+// Translate the code reachable from the entry of the image at `base' into
+// C, written to `fp'. Return the number of blocks.
+int aot_translate(FILE *fp, vaddr_t base, uint32_t size, uint64_t key);
+
+#endif
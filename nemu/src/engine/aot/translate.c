@@ -0,0 +1,342 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/decode.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include "local-include/aot.h"
+
+/* Blocks are found by following the control flow from the entry of the
+ * image, the return addresses of calls, and the addresses which may be
+ * taken by indirect jumps: words of the image holding an address in the
+ * code, and addresses computed by lui/auipc + addi. Then each block is
+ * translated into a C function, which calls the function of the block at
+ * the target of a direct jump, and returns to aot_exec() at an indirect
+ * jump whose target is not translated, the end of the budget, an access
+ * to MMIO, and an instruction without a translation.
+ *
+ * As the JIT, instructions are translated by the names of the INSTPAT
+ * decoding them, so an instruction not implemented by the interpreter is
+ * never translated.
+ */
+
+enum { OP_LUI, OP_AUIPC, OP_JAL, OP_JALR, OP_BRANCH, OP_LOAD, OP_STORE, OP_ALUI, OP_SHIFTI, OP_ALU };
+
+typedef struct {
+  const char *name;
+  int type;
+  // the condition of a branch, the C type of a memory access, or the
+  // result of an operation, of the operands `a' and `b'
+  const char *expr;
+} AotOp;
+
+static const AotOp ops[] = {
+  { "lui", OP_LUI }, { "auipc", OP_AUIPC }, { "jal", OP_JAL }, { "jalr", OP_JALR },
+  { "beq", OP_BRANCH, "a == b" }, { "bne", OP_BRANCH, "a != b" },
+  { "blt", OP_BRANCH, "(int32_t)a < (int32_t)b" }, { "bge", OP_BRANCH, "(int32_t)a >= (int32_t)b" },
+  { "bltu", OP_BRANCH, "a < b" }, { "bgeu", OP_BRANCH, "a >= b" },
+  { "lb", OP_LOAD, "int8_t" }, { "lh", OP_LOAD, "int16_t" }, { "lw", OP_LOAD, "uint32_t" },
+  { "lbu", OP_LOAD, "uint8_t" }, { "lhu", OP_LOAD, "uint16_t" },
+  { "sb", OP_STORE, "uint8_t" }, { "sh", OP_STORE, "uint16_t" }, { "sw", OP_STORE, "uint32_t" },
+  { "addi", OP_ALUI, "a + b" }, { "xori", OP_ALUI, "a ^ b" },
+  { "ori", OP_ALUI, "a | b" }, { "andi", OP_ALUI, "a & b" },
+  { "slti", OP_ALUI, "(int32_t)a < (int32_t)b" }, { "sltiu", OP_ALUI, "a < b" },
+  { "slli", OP_SHIFTI, "a << b" }, { "srli", OP_SHIFTI, "a >> b" },
+  { "srai", OP_SHIFTI, "(int32_t)a >> b" },
+  { "add", OP_ALU, "a + b" }, { "sub", OP_ALU, "a - b" }, { "xor", OP_ALU, "a ^ b" },
+  { "or", OP_ALU, "a | b" }, { "and", OP_ALU, "a & b" },
+  { "slt", OP_ALU, "(int32_t)a < (int32_t)b" }, { "sltu", OP_ALU, "a < b" },
+  { "sll", OP_ALU, "a << (b & 31)" }, { "srl", OP_ALU, "a >> (b & 31)" },
+  { "sra", OP_ALU, "(int32_t)a >> (b & 31)" },
+  { "mul", OP_ALU, "a * b" },
+  { "mulh", OP_ALU, "(int64_t)(int32_t)a * (int32_t)b >> 32" },
+  { "mulhsu", OP_ALU, "(int64_t)(int32_t)a * (int64_t)b >> 32" },
+  { "mulhu", OP_ALU, "(uint64_t)a * b >> 32" },
+  { "div", OP_ALU, "b == 0 ? -1 : a == 0x80000000u && b == -1u ? a : (uint32_t)((int32_t)a / (int32_t)b)" },
+  { "divu", OP_ALU, "b == 0 ? -1 : a / b" },
+  { "rem", OP_ALU, "b == 0 ? a : a == 0x80000000u && b == -1u ? 0 : (uint32_t)((int32_t)a % (int32_t)b)" },
+  { "remu", OP_ALU, "b == 0 ? a : a % b" },
+};
+
+static const AotOp* find_op(const char *name) {
+  for (int i = 0; i < ARRLEN(ops); i ++) {
+    if (strcmp(ops[i].name, name) == 0) return &ops[i];
+  }
+  return NULL;
+}
+
+static inline bool is_jump(const AotOp *op) {
+  return op->type == OP_JAL || op->type == OP_JALR || op->type == OP_BRANCH;
+}
+
+static inline bool is_link(int r) {
+  return r == 1 || r == 5;
+}
+
+#define RD(i)  BITS(i, 11, 7)
+#define RS1(i) BITS(i, 19, 15)
+#define RS2(i) BITS(i, 24, 20)
+#define immI(i) ((word_t)SEXT(BITS(i, 31, 20), 12))
+#define immU(i) ((word_t)SEXT(BITS(i, 31, 12), 20) << 12)
+#define immS(i) (((word_t)SEXT(BITS(i, 31, 25), 7) << 5) | BITS(i, 11, 7))
+#define immB(i) (((word_t)SEXT(BITS(i, 31, 31), 1) << 12) | (BITS(i, 7, 7) << 11) | \
+    (BITS(i, 30, 25) << 5) | (BITS(i, 11, 8) << 1))
+#define immJ(i) (((word_t)SEXT(BITS(i, 31, 31), 1) << 20) | (BITS(i, 19, 12) << 12) | \
+    (BITS(i, 20, 20) << 11) | (BITS(i, 30, 21) << 1))
+
+// state of each word of the image
+enum { W_DECODED = 1, W_LEADER = 2 };
+
+typedef struct {
+  vaddr_t pc;
+  int nr_inst;
+} Block;
+
+static FILE *fp = NULL;
+static vaddr_t base = 0;
+static uint32_t nr_word = 0;
+static uint8_t *state = NULL;
+static const AotOp **op = NULL; // NULL if the word has no translation
+static uint32_t *inst = NULL;
+static bool *valid_inst = NULL; // an instruction, which may have no translation
+static int *block_at = NULL;    // index of the block starting at each word, or -1
+static vaddr_t *work = NULL;
+static int nr_work = 0;
+static Block *blocks = NULL;
+static int nr_block = 0;
+
+static inline bool in_image(vaddr_t pc) {
+  return pc % 4 == 0 && (pc - base) / 4 < nr_word;
+}
+
+static inline uint32_t word_of(vaddr_t pc) {
+  return (pc - base) / 4;
+}
+
+// decode the instruction without executing it
+static void decode(vaddr_t pc) {
+  uint32_t w = word_of(pc);
+  if (state[w] & W_DECODED) return;
+  state[w] |= W_DECODED;
+  DecodeEntry de = { .pc = pc, .decode_only = true };
+  Decode s = { .pc = pc, .snpc = pc, .de = &de };
+  isa_exec_once(&s);
+  inst[w] = de.inst;
+  op[w] = (de.handler == NULL ? NULL : find_op(de.name));
+  valid_inst[w] = (de.handler != NULL && strcmp(de.name, "inv") != 0);
+}
+
+static void add_leader(vaddr_t pc) {
+  if (!in_image(pc)) return;
+  uint32_t w = word_of(pc);
+  if (state[w] & W_LEADER) return;
+  state[w] |= W_LEADER;
+  work[nr_work ++] = pc;
+}
+
+// find the block at a leader, and the leaders it leads to
+static void find_block(vaddr_t start) {
+  int n = 0;
+  vaddr_t pc = start;
+  while (true) {
+    if (n == AOT_MAX_INST) { add_leader(pc); break; }
+    if (!in_image(pc)) break;
+    decode(pc);
+    uint32_t w = word_of(pc);
+    const AotOp *o = op[w];
+    if (o == NULL) {
+      // run by the interpreter, which goes on with the next instruction
+      if (valid_inst[w]) add_leader(pc + 4);
+      break;
+    }
+    n ++;
+    if (is_jump(o)) {
+      uint32_t i = inst[w];
+      switch (o->type) {
+        case OP_JAL: add_leader(pc + immJ(i)); break;
+        case OP_BRANCH: add_leader(pc + immB(i)); add_leader(pc + 4); break;
+      }
+      // where a call returns
+      if (o->type != OP_BRANCH && is_link(RD(i))) add_leader(pc + 4);
+      break;
+    }
+    pc += 4;
+  }
+  if (n == 0) return;
+  block_at[word_of(start)] = nr_block;
+  blocks[nr_block ++] = (Block) { .pc = start, .nr_inst = n };
+}
+
+// Addresses which may be taken by indirect jumps are tried as leaders if
+// their first instructions have translations. Translating some data by
+// mistake only costs time, as it is never run as code.
+static void add_addresses() {
+  for (uint32_t w = 0; w < nr_word; w ++) {
+    vaddr_t pc = base + w * 4;
+    uint32_t data = vaddr_read(pc, 4);
+    vaddr_t addr[2] = { data, 1 };
+    decode(pc);
+    if (op[w] != NULL && (op[w]->type == OP_LUI || op[w]->type == OP_AUIPC) && w + 1 < nr_word) {
+      decode(pc + 4);
+      uint32_t i0 = inst[w], i1 = inst[w + 1];
+      if (op[w + 1] != NULL && strcmp(op[w + 1]->name, "addi") == 0 && RS1(i1) == RD(i0)) {
+        addr[1] = (op[w]->type == OP_AUIPC ? pc : 0) + immU(i0) + immI(i1);
+      }
+    }
+    for (int k = 0; k < 2; k ++) {
+      if (!in_image(addr[k])) continue;
+      decode(addr[k]);
+      if (op[word_of(addr[k])] != NULL) add_leader(addr[k]);
+    }
+  }
+}
+
+static void emit_goto(int nr, vaddr_t target) {
+  int b = (in_image(target) ? block_at[word_of(target)] : -1);
+  if (b >= 0) fprintf(fp, "GOTO(%d, b%d);", nr, b);
+  else fprintf(fp, "EXIT(%d, 0x%xu);", nr, target);
+}
+
+static void emit_inst(const AotOp *o, uint32_t i, vaddr_t pc, int k) {
+  int rd = RD(i), rs1 = RS1(i), rs2 = RS2(i);
+  fprintf(fp, "  ");
+  switch (o->type) {
+    case OP_LUI: if (rd != 0) fprintf(fp, "r[%d] = 0x%xu;", rd, immU(i)); break;
+    case OP_AUIPC: if (rd != 0) fprintf(fp, "r[%d] = 0x%xu;", rd, pc + immU(i)); break;
+    case OP_JAL:
+      if (rd != 0) fprintf(fp, "r[%d] = 0x%xu; ", rd, pc + 4);
+      emit_goto(k + 1, pc + immJ(i));
+      break;
+    case OP_JALR:
+      fprintf(fp, "{ uint32_t t = (r[%d] + 0x%xu) & ~1u; ", rs1, immI(i));
+      if (rd != 0) fprintf(fp, "r[%d] = 0x%xu; ", rd, pc + 4);
+      fprintf(fp, "e->left -= %d; dispatch(e, t); return; }", k + 1);
+      break;
+    case OP_BRANCH:
+      fprintf(fp, "{ uint32_t a = r[%d], b = r[%d]; if (%s) ", rs1, rs2, o->expr);
+      emit_goto(k + 1, pc + immB(i));
+      fprintf(fp, " }\n  ");
+      emit_goto(k + 1, pc + 4);
+      break;
+    case OP_LOAD:
+      fprintf(fp, "{ uint32_t a = r[%d] + 0x%xu - MBASE; %s v; if (a > MSIZE - sizeof(v)) EXIT(%d, 0x%xu); "
+          "memcpy(&v, m + a, sizeof(v));", rs1, immI(i), o->expr, k, pc);
+      if (rd != 0) fprintf(fp, " r[%d] = v;", rd);
+      fprintf(fp, " }");
+      break;
+    case OP_STORE:
+      fprintf(fp, "{ uint32_t a = r[%d] + 0x%xu - MBASE; %s v = r[%d]; if (a > MSIZE - sizeof(v)) EXIT(%d, 0x%xu);\n"
+          "    if (!STORE_SLOW(a, sizeof(v))) memcpy(m + a, &v, sizeof(v));\n"
+          "    else if (e->store(a + MBASE, sizeof(v), v)) EXIT(%d, 0x%xu); }",
+          rs1, (word_t)immS(i), o->expr, rs2, k, pc, k + 1, pc + 4);
+      break;
+    case OP_ALUI: case OP_SHIFTI:
+      // the shift amount is in the field of rs2
+      if (rd != 0) fprintf(fp, "{ uint32_t a = r[%d], b = 0x%xu; r[%d] = %s; }",
+          rs1, (o->type == OP_SHIFTI ? rs2 : immI(i)), rd, o->expr);
+      break;
+    case OP_ALU:
+      if (rd != 0) fprintf(fp, "{ uint32_t a = r[%d], b = r[%d]; r[%d] = %s; }", rs1, rs2, rd, o->expr);
+      break;
+    default: panic("unknown operation %d", o->type);
+  }
+  fprintf(fp, "\n");
+}
+
+static void emit_block(int idx) {
+  Block *b = &blocks[idx];
+  fprintf(fp, "\nstatic void b%d(AotEnv *e) { // " FMT_WORD "\n", idx, b->pc);
+  fprintf(fp, "  uint32_t *restrict r = e->gpr;\n  uint8_t *m = e->mem;\n");
+  fprintf(fp, "  if (e->left < %d || !e->valid[%d]) EXIT(0, 0x%xu);\n", b->nr_inst, idx, b->pc);
+  const AotOp *o = NULL;
+  for (int k = 0; k < b->nr_inst; k ++) {
+    vaddr_t pc = b->pc + k * 4;
+    o = op[word_of(pc)];
+    emit_inst(o, inst[word_of(pc)], pc, k);
+  }
+  if (!is_jump(o)) {
+    fprintf(fp, "  ");
+    emit_goto(b->nr_inst, b->pc + b->nr_inst * 4);
+    fprintf(fp, "\n");
+  }
+  fprintf(fp, "}\n");
+}
+
+static void emit(uint64_t key, uint32_t size) {
+  fprintf(fp, "// Translated by NEMU from the image at " FMT_WORD ", do not edit\n", base);
+  fprintf(fp, "#include <stdint.h>\n#include <string.h>\n\n%s\n\n", aot_abi);
+  fprintf(fp, "#define MBASE 0x%xu\n#define MSIZE 0x%xu\n", (uint32_t)CONFIG_MBASE, (uint32_t)CONFIG_MSIZE);
+  fprintf(fp, "#define IMG 0x%xu\n#define IMG_SIZE 0x%xu\n", base - (uint32_t)CONFIG_MBASE, size);
+  fprintf(fp, "#define EXIT(nr, npc) do { e->left -= (nr); *e->pc = (npc); return; } while (0)\n");
+  fprintf(fp, "#define GOTO(nr, b) do { e->left -= (nr); b(e); return; } while (0)\n\n");
+  fprintf(fp,
+      "static inline int is_code(const AotEnv *e, uint32_t a) {\n"
+      "  a -= IMG;\n"
+      "  return a < IMG_SIZE && (e->code[a >> 7] >> (a >> 2 & 31) & 1);\n"
+      "}\n\n"
+      "static inline int is_clean(const AotEnv *e, uint32_t a) {\n"
+      "  a >>= %d;\n"
+      "  return !(e->dirty[a >> 6] >> (a & 63) & 1);\n"
+      "}\n\n"
+      "// a store which may write decoded or translated instructions, or clean pages\n"
+      "#define STORE_SLOW(a, len) (e->live[(a) >> %d] != 0 || is_code(e, a) || is_code(e, (a) + (len) - 1) || \\\n"
+      "    is_clean(e, a) || is_clean(e, (a) + (len) - 1))\n\n",
+      PAGE_SHIFT, PAGE_SHIFT);
+
+  fprintf(fp, "static void dispatch(AotEnv *e, uint32_t pc);\n");
+  for (int b = 0; b < nr_block; b ++) fprintf(fp, "static void b%d(AotEnv *e);\n", b);
+  for (int b = 0; b < nr_block; b ++) emit_block(b);
+
+  fprintf(fp, "\nstatic void dispatch(AotEnv *e, uint32_t pc) {\n  switch (pc) {\n");
+  for (int b = 0; b < nr_block; b ++) {
+    fprintf(fp, "    case 0x%xu: b%d(e); return;\n", blocks[b].pc, b);
+  }
+  fprintf(fp, "  }\n  *e->pc = pc;\n}\n\n");
+
+  fprintf(fp, "const char aot_abi[] = \"%s\";\n", aot_abi);
+  fprintf(fp, "const uint64_t aot_key = 0x%" PRIx64 "ull;\n", key);
+  fprintf(fp, "const uint32_t aot_nr_blocks = %d;\n", nr_block);
+  fprintf(fp, "const AotBlock aot_blocks[] = {\n");
+  for (int b = 0; b < nr_block; b ++) {
+    fprintf(fp, "  { 0x%xu, %d, b%d },\n", blocks[b].pc, blocks[b].nr_inst, b);
+  }
+  fprintf(fp, "  { 0, 0, 0 }\n};\n");
+}
+
+int aot_translate(FILE *out, vaddr_t img_base, uint32_t size, uint64_t key) {
+  fp = out;
+  base = img_base;
+  nr_word = size / 4;
+  state = calloc(nr_word, sizeof(*state));
+  op = calloc(nr_word, sizeof(*op));
+  inst = calloc(nr_word, sizeof(*inst));
+  valid_inst = calloc(nr_word, sizeof(*valid_inst));
+  block_at = malloc(nr_word * sizeof(*block_at));
+  work = malloc(nr_word * sizeof(*work));
+  blocks = malloc(nr_word * sizeof(*blocks));
+  assert(state && op && inst && valid_inst && block_at && work && blocks);
+  memset(block_at, -1, nr_word * sizeof(*block_at));
+  nr_work = nr_block = 0;
+
+  add_leader(base);
+  add_addresses();
+  while (nr_work > 0) find_block(work[-- nr_work]);
+  emit(key, size);
+
+  free(state); free(op); free(inst); free(valid_inst);
+  free(block_at); free(work); free(blocks);
+  return nr_block;
+}
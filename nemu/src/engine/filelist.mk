@@ -15,3 +15,8 @@
 
 INC_PATH += $(NEMU_HOME)/src/engine/$(ENGINE)
 DIRS-y += src/engine/$(ENGINE)
+
+# the other engines share the host calls with the interpreter
+SRCS-$(CONFIG_ENGINE_THREADED) += src/engine/interpreter/hostcall.c
+SRCS-$(CONFIG_ENGINE_JIT) += src/engine/interpreter/hostcall.c
+SRCS-$(CONFIG_ENGINE_AOT) += src/engine/interpreter/hostcall.c
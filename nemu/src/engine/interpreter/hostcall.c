@@ -16,10 +16,12 @@
 #include <utils.h>
 #include <cpu/ifetch.h>
 #include <isa.h>
+#include <cpu/cpu.h>
 #include <cpu/difftest.h>
 
 void set_nemu_state(int state, vaddr_t pc, int halt_ret) {
   difftest_skip_ref();
+  cpu_end_run();
   nemu_state.state = state;
   nemu_state.halt_pc = pc;
   nemu_state.halt_ret = halt_ret;
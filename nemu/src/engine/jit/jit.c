@@ -0,0 +1,290 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <cpu/jit.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <sys/mman.h>
+#include "local-include/jit.h"
+#include "local-include/x86.h"
+
+#define JIT_CACHE_SIZE (32 * 1024 * 1024)
+// translate a block when it is reached this many times
+#define JIT_HOT 4
+#define NR_BUCKET 65536
+#define NR_JPAGE (CONFIG_MSIZE / PAGE_SIZE)
+
+// returned by translated code in rax and rdx
+typedef struct {
+  uint64_t left;  // instructions left in the budget
+  uintptr_t exit; // JIT_EXIT_*, or the JitLink of an unchained jump
+} JitRet;
+
+uint8_t *x86_ptr = NULL;
+uint8_t *jit_exit = NULL;
+JitJump jit_jcache[NR_JCACHE] = {};
+JitRas jit_ras = {};
+static uint8_t *cache = NULL;
+static JitRet (*jit_enter)(uint8_t *code, uint64_t budget) = NULL;
+
+static JitBlock *bucket[NR_BUCKET] = {};
+// translated blocks of each page of pmem
+static JitBlock *jpage[NR_JPAGE] = {};
+static uint64_t nr_translate = 0, nr_invalidate = 0, nr_flush = 0, nr_native = 0;
+static uint64_t nr_enter = 0, nr_chain = 0, nr_unchained = 0, nr_exit[JIT_EXIT_NR] = {};
+
+// The entry saves the callee-saved registers, sets up the stack frame and
+// the registers shared by all translated code, then jumps to the block.
+static void emit_entry() {
+  static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+  x86_ptr = cache;
+  jit_enter = (void *)x86_ptr;
+  for (int i = 0; i < ARRLEN(saved); i ++) x86_push(saved[i]);
+  // the frame also keeps the stack aligned for helper calls
+  x86_alu_rm_imm(X86_W, ALU_SUB, X86_REG(RSP), JIT_FRAME_SIZE);
+  x86_mov64_rm_r(X86_MEM(RSP, JIT_FRAME_LEFT), RSI);
+  x86_mov64_rm_r(X86_MEM(RSP, JIT_FRAME_BUDGET), RSI);
+  x86_alu_r_rm(ALU_XOR, RAX, X86_REG(RAX));
+  x86_mov64_rm_r(X86_MEM(RSP, JIT_FRAME_CHAIN), RAX);
+  x86_mov64_r_imm(R15, (uintptr_t)&cpu);
+  x86_mov64_r_imm(R14, (uintptr_t)guest_to_host(CONFIG_MBASE));
+  x86_mov64_r_imm(R13, (uintptr_t)dcache_live_table());
+  x86_mov64_r_imm(R12, (uintptr_t)paddr_dirty_bitmap());
+  x86_jmp_r(RDI);
+
+  // rdx is set by the block
+  jit_exit = x86_ptr;
+  x86_mov64_r_rm(RCX, X86_MEM(RSP, JIT_FRAME_CHAIN));
+  x86_mov64_r_imm(RAX, (uintptr_t)&nr_chain);
+  x86_modrm(X86_W, 0x01, RCX, X86_MEM(RAX, 0)); // add [rax], rcx
+  x86_mov64_r_rm(RAX, X86_MEM(RSP, JIT_FRAME_LEFT));
+  x86_alu_rm_imm(X86_W, ALU_ADD, X86_REG(RSP), JIT_FRAME_SIZE);
+  for (int i = ARRLEN(saved) - 1; i >= 0; i --) x86_pop(saved[i]);
+  x86_ret();
+}
+
+static void reset_jump_cache() {
+  for (int i = 0; i < NR_JCACHE; i ++) jit_jcache[i] = (JitJump) { .pc = 1 };
+  jit_ras = (JitRas) { .nr_hit = jit_ras.nr_hit };
+  for (int i = 0; i < NR_RAS; i ++) jit_ras.e[i].pc = 1;
+}
+
+static void init_cache() {
+  cache = mmap(NULL, JIT_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  Assert(cache != MAP_FAILED, "Can not allocate the code cache");
+  emit_entry();
+  reset_jump_cache();
+}
+
+static JitBlock* find_block(vaddr_t pc) {
+  for (JitBlock *b = bucket[(pc / 4) % NR_BUCKET]; b != NULL; b = b->next) {
+    if (b->pc == pc) return b;
+  }
+  return NULL;
+}
+
+JitBlock* jit_lookup(vaddr_t pc) {
+  JitBlock *b = find_block(pc);
+  if (b != NULL) return b;
+  JitBlock **head = &bucket[(pc / 4) % NR_BUCKET];
+  b = calloc(1, sizeof(JitBlock));
+  assert(b);
+  b->pc = pc;
+  b->next = *head;
+  *head = b;
+  return b;
+}
+
+uint64_t jit_exec(uint64_t n) {
+  vaddr_t pc = cpu.pc;
+  // blocks are indexed and invalidated by physical address as the decode cache
+  if (pc % 4 != 0 || !in_pmem(pc) || isa_mmu_check(pc, 4, MEM_TYPE_IFETCH) != MMU_DIRECT) return 0;
+  if (unlikely(cache == NULL)) init_cache();
+
+  JitBlock *b = jit_lookup(pc);
+  if (unlikely(b->nr_inst == 0)) {
+    if (++ b->nr_exec < JIT_HOT) return 0;
+    if (x86_ptr + JIT_MAX_CODE > cache + JIT_CACHE_SIZE) {
+      jit_flush();
+      b = jit_lookup(pc);
+    }
+    if (!jit_translate(b)) {
+      b->nr_exec = 0;
+      return 0;
+    }
+    JitBlock **p = &jpage[(pc - CONFIG_MBASE) / PAGE_SIZE];
+    b->page_next = *p;
+    *p = b;
+    nr_translate ++;
+  }
+  if (b->nr_inst > n) return 0;
+  if (b->entry != NULL) {
+    // the block is likely reached by an indirect jump again
+    JitJump *j = &jit_jcache[(pc / 4) % NR_JCACHE];
+    j->pc = pc;
+    j->entry = b->entry;
+  }
+
+  JitRet ret = jit_enter(b->code, n);
+  uint64_t nr = n - ret.left;
+  nr_native += nr;
+  nr_enter ++;
+  if (ret.exit < JIT_EXIT_NR) nr_exit[ret.exit] ++;
+  else {
+    // chain the jump to its target if translated
+    nr_unchained ++;
+    JitBlock *target = find_block(cpu.pc);
+    if (target != NULL && target->entry != NULL) {
+      JitLink *l = (JitLink *)ret.exit;
+      x86_patch(l->rel, target->entry);
+      l->to = target;
+      l->next = target->link;
+      if (l->next != NULL) l->next->pprev = &l->next;
+      l->pprev = &target->link;
+      target->link = l;
+    }
+  }
+  return nr;
+}
+
+JitLink* jit_new_link(JitBlock *b, uint8_t *rel) {
+  JitLink *l = calloc(1, sizeof(JitLink));
+  assert(l);
+  l->rel = rel;
+  l->out_next = b->out;
+  b->out = l;
+  return l;
+}
+
+// Jumps chained to the block fall through to their exits again.
+static void unchain(JitBlock *b) {
+  for (JitLink *l = b->link; l != NULL; l = l->next) {
+    x86_patch(l->rel, l->rel + 4);
+    l->to = NULL;
+  }
+  b->link = NULL;
+}
+
+// free the jumps of the block, which are removed from the blocks chained to
+static void free_links(JitBlock *b) {
+  JitLink *l = b->out;
+  while (l != NULL) {
+    JitLink *next = l->out_next;
+    if (l->to != NULL) {
+      *l->pprev = l->next;
+      if (l->next != NULL) l->next->pprev = l->pprev;
+    }
+    free(l);
+    l = next;
+  }
+  b->out = NULL;
+}
+
+void jit_invalidate(paddr_t addr, int len) {
+  paddr_t end = addr + len;
+  paddr_t last = (end - 1 - CONFIG_MBASE) / PAGE_SIZE;
+  if (last >= NR_JPAGE) last = NR_JPAGE - 1;
+  for (paddr_t i = (addr - CONFIG_MBASE) / PAGE_SIZE; i <= last; i ++) {
+    JitBlock **p = &jpage[i];
+    while (*p != NULL) {
+      JitBlock *b = *p;
+      if (b->pc < end && addr < b->pc + b->nr_inst * 4) {
+        *p = b->page_next;
+        unchain(b);
+        free_links(b);
+        JitJump *j = &jit_jcache[(b->pc / 4) % NR_JCACHE];
+        if (j->pc == b->pc) j->pc = 1;
+        for (int k = 0; k < NR_RAS; k ++) {
+          if (jit_ras.e[k].b == b) jit_ras.e[k].pc = 1;
+        }
+        // calls translated still push the block, which is missed until translated again
+        b->nr_inst = b->nr_exec = 0;
+        b->code = b->entry = NULL;
+        nr_invalidate ++;
+      } else {
+        p = &b->page_next;
+      }
+    }
+  }
+}
+
+void jit_flush() {
+  if (cache == NULL) return;
+  // links are removed from the blocks chained to, which are freed later
+  for (int i = 0; i < NR_BUCKET; i ++) {
+    for (JitBlock *b = bucket[i]; b != NULL; b = b->next) free_links(b);
+  }
+  for (int i = 0; i < NR_BUCKET; i ++) {
+    JitBlock *b = bucket[i];
+    while (b != NULL) {
+      JitBlock *next = b->next;
+      free(b);
+      b = next;
+    }
+    bucket[i] = NULL;
+  }
+  memset(jpage, 0, sizeof(jpage));
+  emit_entry();
+  reset_jump_cache();
+  nr_flush ++;
+}
+
+void jit_load(paddr_t addr, int len, int rd, int sign) {
+  word_t data = vaddr_load(addr, len);
+  if (sign) data = (len == 1 ? (int8_t)data : (int16_t)data);
+  if (rd != 0) cpu.gpr[rd] = data;
+}
+
+int jit_store(paddr_t addr, int len, word_t data, int idx) {
+  if (!in_pmem(addr)) {
+    if (idx > 0) return JIT_STORE_SKIPPED;
+    vaddr_store(addr, len, data);
+    return JIT_STORE_EXIT;
+  }
+  uint64_t nr = nr_invalidate;
+  vaddr_store(addr, len, data);
+  return (nr == nr_invalidate ? JIT_STORE_CONTINUE : JIT_STORE_EXIT);
+}
+
+void jit_interp(vaddr_t pc) {
+  Decode s;
+  s.pc = s.snpc = pc;
+  s.de = dcache_lookup(pc);
+  isa_exec_once(&s);
+  cpu.pc = s.dnpc;
+}
+
+void jit_set_fusion(bool enable) {
+  jit_fusion = enable;
+  jit_flush();
+}
+
+void jit_statistic() {
+  Log("jit: translated blocks = " NUMBERIC_FMT ", invalidated = " NUMBERIC_FMT
+      ", cache flushes = " NUMBERIC_FMT ", native instructions = " NUMBERIC_FMT
+      ", fused pairs = " NUMBERIC_FMT "%s",
+      nr_translate, nr_invalidate, nr_flush, nr_native, jit_nr_fused, jit_fusion ? "" : " (disabled)");
+  uint64_t nr_block = nr_enter + nr_chain;
+  if (nr_block == 0) return;
+  Log("jit: blocks run = " NUMBERIC_FMT ", chain hit rate = %.2f%%, return address stack hits = "
+      NUMBERIC_FMT ", returns to the dispatcher: unchained jumps = " NUMBERIC_FMT
+      ", jump cache misses = " NUMBERIC_FMT ", out of budget = " NUMBERIC_FMT ", others = " NUMBERIC_FMT,
+      nr_block, 100.0 * nr_chain / nr_block, jit_ras.nr_hit, nr_unchained, nr_exit[JIT_EXIT_INDIRECT],
+      nr_exit[JIT_EXIT_BUDGET], nr_exit[JIT_EXIT_OTHER]);
+}
@@ -0,0 +1,104 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __JIT_JIT_H__
+#define __JIT_JIT_H__
+
+#include <common.h>
+
+#define JIT_MAX_INST 64            // guest instructions per block
+#define JIT_MAX_CODE (32 * 1024)   // host code bytes per block
+
+#define NR_JCACHE 4096             // entries of the jump cache
+#define NR_RAS 16                  // entries of the return address stack
+
+// a jump at an exit of a block, owned by the block
+typedef struct JitLink {
+  uint8_t *rel;
+  struct JitBlock *to;            // the block chained to, NULL if not chained
+  struct JitLink *out_next;       // jumps in the same block
+  struct JitLink *next, **pprev;  // jumps chained to the same block
+} JitLink;
+
+typedef struct JitBlock {
+  vaddr_t pc;
+  uint32_t nr_inst;  // guest instructions translated, 0 if not translated
+  uint32_t nr_exec;  // times reached before translation
+  uint8_t *code;     // entered from jit_exec()
+  uint8_t *entry;    // entered from other blocks, NULL if it can not be chained
+  JitLink *link;     // chained jumps to `entry'
+  JitLink *out;      // jumps at the exits
+  struct JitBlock *next;      // in the same hash bucket
+  struct JitBlock *page_next; // translated blocks in the same page
+} JitBlock;
+
+// Cache of indirect jump targets, indexed by (pc / 4) % NR_JCACHE. An
+// empty entry has an odd pc, which is never a target.
+typedef struct {
+  vaddr_t pc;
+  uint8_t *entry;
+} JitJump;
+
+// return addresses pushed by calls, and popped by returns
+typedef struct {
+  uint32_t top;
+  struct {
+    vaddr_t pc;
+    JitBlock *b;
+  } e[NR_RAS];
+  uint64_t nr_hit;   // returns jumping to the block popped
+} JitRas;
+
+extern JitJump jit_jcache[NR_JCACHE];
+extern JitRas jit_ras;
+
+// Why translated code returns to jit_exec(), other than an unchained
+// jump, in which case the JitLink of the jump is returned.
+enum { JIT_EXIT_OTHER, JIT_EXIT_INDIRECT, JIT_EXIT_BUDGET, JIT_EXIT_NR };
+
+// The stack frame of translated code:
+//   [rsp] = instructions left to execute, [rsp + 8] = the budget on entry,
+//   [rsp + 16] = blocks entered by chaining
+#define JIT_FRAME_LEFT   0
+#define JIT_FRAME_BUDGET 8
+#define JIT_FRAME_CHAIN  16
+#define JIT_FRAME_SIZE   24
+
+// entry of the code cache, set up by jit.c
+extern uint8_t *jit_exit;
+
+// whether to fuse common pairs of instructions, and the pairs fused
+extern bool jit_fusion;
+extern uint64_t jit_nr_fused;
+
+// find the block at `pc', which is created if not found
+JitBlock* jit_lookup(vaddr_t pc);
+
+// a jump at `rel' in the block `b'
+JitLink* jit_new_link(JitBlock *b, uint8_t *rel);
+
+// translate the block at `b->pc' at `x86_ptr', return false if the
+// first instruction is not decoded yet
+bool jit_translate(JitBlock *b);
+
+// results of jit_store()
+enum { JIT_STORE_SKIPPED, JIT_STORE_EXIT, JIT_STORE_CONTINUE };
+
+// helpers called by translated code
+void jit_load(paddr_t addr, int len, int rd, int sign);
+int jit_store(paddr_t addr, int len, word_t data, int idx);
+void jit_interp(vaddr_t pc);
+
+#endif
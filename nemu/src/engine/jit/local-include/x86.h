@@ -0,0 +1,173 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __JIT_X86_H__
+#define __JIT_X86_H__
+
+#include <common.h>
+
+// A tiny x86-64 assembler for the code generator. Instructions are
+// emitted at `x86_ptr'.
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum { CC_O, CC_NO, CC_B, CC_AE, CC_E, CC_NE, CC_BE, CC_A,
+       CC_S, CC_NS, CC_P, CC_NP, CC_L, CC_GE, CC_LE, CC_G };
+enum { ALU_ADD, ALU_OR, ALU_ADC, ALU_SBB, ALU_AND, ALU_SUB, ALU_XOR, ALU_CMP };
+enum { SH_SHL = 4, SH_SHR = 5, SH_SAR = 7 };
+
+// operand size and prefixes
+#define X86_W    0x1 // 64-bit operand
+#define X86_16   0x2 // 16-bit operand
+#define X86_BYTE 0x4 // 8-bit register operand
+
+// a register, or memory at [base + index * scale + disp]
+typedef struct {
+  int8_t reg, base, index, scale;
+  int32_t disp;
+} X86Opnd;
+
+#define X86_REG(r) ((X86Opnd) { .reg = (r), .base = -1, .index = -1 })
+#define X86_MEM(b, d) ((X86Opnd) { .reg = -1, .base = (b), .index = -1, .disp = (d) })
+#define X86_MEM_IDX(b, i, s) X86_MEM_IDX_DISP(b, i, s, 0)
+#define X86_MEM_IDX_DISP(b, i, s, d) \
+  ((X86Opnd) { .reg = -1, .base = (b), .index = (i), .scale = (s), .disp = (d) })
+
+extern uint8_t *x86_ptr;
+
+static inline void x86_byte(uint8_t b) { *x86_ptr ++ = b; }
+static inline void x86_word(uint32_t w) { memcpy(x86_ptr, &w, 4); x86_ptr += 4; }
+static inline void x86_dword(uint64_t w) { memcpy(x86_ptr, &w, 8); x86_ptr += 8; }
+static inline bool x86_fit8(int32_t x) { return x == (int8_t)x; }
+
+// emit [prefix] [REX] opcode ModRM [SIB] [disp], with `reg' in ModRM.reg
+static inline void x86_modrm(int flags, uint32_t opcode, int reg, X86Opnd rm) {
+  if (flags & X86_16) x86_byte(0x66);
+  int rmreg = (rm.reg >= 0 ? rm.reg : rm.base);
+  uint8_t rex = 0x40 | ((flags & X86_W) ? 8 : 0) | ((reg >> 3) << 2) |
+    ((rm.index >= 0 ? rm.index >> 3 : 0) << 1) | (rmreg >> 3);
+  bool byte_reg = (flags & X86_BYTE) && ((reg >= 4 && reg < 8) || (rm.reg >= 4 && rm.reg < 8));
+  if (rex != 0x40 || byte_reg) x86_byte(rex);
+  if (opcode > 0xff) x86_byte(opcode >> 8);
+  x86_byte(opcode);
+
+  if (rm.reg >= 0) { x86_byte(0xc0 | (reg & 7) << 3 | (rm.reg & 7)); return; }
+  int mod = (rm.disp == 0 && (rm.base & 7) != RBP ? 0 : x86_fit8(rm.disp) ? 1 : 2);
+  if (rm.index < 0 && (rm.base & 7) != RSP) {
+    x86_byte(mod << 6 | (reg & 7) << 3 | (rm.base & 7));
+  } else {
+    int ss = (rm.scale == 8 ? 3 : rm.scale == 4 ? 2 : rm.scale == 2 ? 1 : 0);
+    x86_byte(mod << 6 | (reg & 7) << 3 | RSP);
+    x86_byte(ss << 6 | (rm.index >= 0 ? rm.index & 7 : RSP) << 3 | (rm.base & 7));
+  }
+  if (mod == 1) x86_byte(rm.disp);
+  else if (mod == 2) x86_word(rm.disp);
+}
+
+static inline void x86_mov_r_rm(int r, X86Opnd rm) { x86_modrm(0, 0x8b, r, rm); }
+static inline void x86_mov_rm_r(X86Opnd rm, int r) { x86_modrm(0, 0x89, r, rm); }
+static inline void x86_mov64_r_rm(int r, X86Opnd rm) { x86_modrm(X86_W, 0x8b, r, rm); }
+static inline void x86_mov64_rm_r(X86Opnd rm, int r) { x86_modrm(X86_W, 0x89, r, rm); }
+static inline void x86_mov_rm_imm(X86Opnd rm, uint32_t imm) { x86_modrm(0, 0xc7, 0, rm); x86_word(imm); }
+
+static inline void x86_mov_r_imm(int r, uint32_t imm) {
+  if (r >= 8) x86_byte(0x41);
+  x86_byte(0xb8 + (r & 7));
+  x86_word(imm);
+}
+
+static inline void x86_mov64_r_imm(int r, uint64_t imm) {
+  x86_byte(0x48 | (r >> 3));
+  x86_byte(0xb8 + (r & 7));
+  x86_dword(imm);
+}
+
+// load `len' bytes from `rm' to `r', with zero or sign extension
+static inline void x86_load(int r, X86Opnd rm, int len, bool sign) {
+  switch (len) {
+    case 1: x86_modrm(X86_BYTE, sign ? 0x0fbe : 0x0fb6, r, rm); break;
+    case 2: x86_modrm(0, sign ? 0x0fbf : 0x0fb7, r, rm); break;
+    default: x86_mov_r_rm(r, rm); break;
+  }
+}
+
+// store the lowest `len' bytes of `r' to `rm'
+static inline void x86_store(X86Opnd rm, int r, int len) {
+  switch (len) {
+    case 1: x86_modrm(X86_BYTE, 0x88, r, rm); break;
+    case 2: x86_modrm(X86_16, 0x89, r, rm); break;
+    default: x86_mov_rm_r(rm, r); break;
+  }
+}
+
+static inline void x86_alu_r_rm(int op, int r, X86Opnd rm) { x86_modrm(0, op * 8 + 3, r, rm); }
+static inline void x86_alu64_r_rm(int op, int r, X86Opnd rm) { x86_modrm(X86_W, op * 8 + 3, r, rm); }
+
+static inline void x86_alu_rm_imm(int flags, int op, X86Opnd rm, int32_t imm) {
+  if (x86_fit8(imm)) { x86_modrm(flags, 0x83, op, rm); x86_byte(imm); }
+  else { x86_modrm(flags, 0x81, op, rm); x86_word(imm); }
+}
+
+static inline void x86_test_r_r(int r1, int r2) { x86_modrm(0, 0x85, r2, X86_REG(r1)); }
+// CF = bit `r' of the bit string at `rm'
+static inline void x86_bt_rm_r(X86Opnd rm, int r) { x86_modrm(X86_W, 0x0fa3, r, rm); }
+static inline void x86_shift_cl(int op, X86Opnd rm) { x86_modrm(0, 0xd3, op, rm); }
+
+static inline void x86_shift_imm(int flags, int op, X86Opnd rm, uint8_t imm) {
+  x86_modrm(flags, 0xc1, op, rm);
+  x86_byte(imm);
+}
+
+static inline void x86_imul_r_rm(int flags, int r, X86Opnd rm) { x86_modrm(flags, 0x0faf, r, rm); }
+static inline void x86_movsxd(int r, X86Opnd rm) { x86_modrm(X86_W, 0x63, r, rm); }
+static inline void x86_setcc(int cc, int r) { x86_modrm(X86_BYTE, 0x0f90 + cc, 0, X86_REG(r)); }
+static inline void x86_cdq() { x86_byte(0x99); }
+static inline void x86_div(X86Opnd rm) { x86_modrm(0, 0xf7, 6, rm); }
+static inline void x86_idiv(X86Opnd rm) { x86_modrm(0, 0xf7, 7, rm); }
+
+static inline void x86_push(int r) { if (r >= 8) x86_byte(0x41); x86_byte(0x50 + (r & 7)); }
+static inline void x86_pop(int r) { if (r >= 8) x86_byte(0x41); x86_byte(0x58 + (r & 7)); }
+static inline void x86_ret() { x86_byte(0xc3); }
+static inline void x86_jmp_rm(X86Opnd rm) { x86_modrm(0, 0xff, 4, rm); }
+static inline void x86_jmp_r(int r) { x86_jmp_rm(X86_REG(r)); }
+
+static inline void x86_call(void *fn) {
+  x86_mov64_r_imm(RAX, (uintptr_t)fn);
+  x86_modrm(0, 0xff, 2, X86_REG(RAX));
+}
+
+// Jumps are emitted with a 32-bit displacement, and the returned pointer
+// to the displacement is used to set the target later.
+static inline void x86_patch(uint8_t *rel, const uint8_t *target) {
+  int32_t disp = target - (rel + 4);
+  memcpy(rel, &disp, 4);
+}
+
+static inline uint8_t* x86_jcc(int cc) {
+  x86_byte(0x0f); x86_byte(0x80 + cc);
+  uint8_t *rel = x86_ptr;
+  x86_word(0);
+  return rel;
+}
+
+static inline uint8_t* x86_jmp() {
+  x86_byte(0xe9);
+  uint8_t *rel = x86_ptr;
+  x86_word(0);
+  return rel;
+}
+
+static inline void x86_jmp_to(const uint8_t *target) { x86_patch(x86_jmp(), target); }
+
+#endif
@@ -0,0 +1,622 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <stddef.h>
+#include <isa.h>
+#include <cpu/decode.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include "local-include/jit.h"
+#include "local-include/x86.h"
+
+#ifndef __x86_64__
+#error "The JIT engine only supports x86-64 hosts"
+#endif
+
+/* Instructions are translated according to the name of the INSTPAT they
+ * are decoded by, so an instruction not implemented by the interpreter is
+ * never translated. Instructions without a native translation (system
+ * instructions, traps, and so on) stop the block, and a block starting
+ * with such an instruction runs it with the interpreter.
+ *
+ * Register usage of translated code:
+ *   r15 = &cpu, r14 = host address of pmem, r13 = dcache_live_table(),
+ *   r12 = paddr_dirty_bitmap()
+ *   rax, rcx, rdx: scratch
+ *   rbx, rbp, rsi, rdi, r8 - r11: cache of guest registers
+ *
+ * Blocks jump to each other without returning to jit_exec(): a direct
+ * jump is chained to the block at its target once that is translated,
+ * and an indirect jump looks up the return address stack if it is a
+ * return, then the jump cache. The guest registers are written back
+ * before leaving a block, so the cached ones are free to clobber then.
+ *
+ * Common pairs of instructions are fused, see translate_pair(). This is
+ * done only here but not in the decoder: the interpreter and the threaded
+ * engines run one DecodeEntry per instruction, which is also the unit of
+ * single stepping, watchpoints, itrace and difftest, and they would save
+ * no more than a dispatch per pair. Translated code checks none of these
+ * between instructions, and a pair saves the intermediate value there.
+ */
+
+enum {
+  OP_LUI, OP_AUIPC, OP_JAL, OP_JALR, OP_BRANCH, OP_LOAD, OP_STORE,
+  OP_ALUI, OP_SLTI, OP_SHIFTI, OP_ALU, OP_SLT, OP_SHIFT, OP_MUL, OP_MULH, OP_DIV,
+};
+
+typedef struct {
+  const char *name;
+  int type;
+  int arg;   // x86 operation, condition code, or access length
+  bool sign; // signed load or division
+} JitOp;
+
+// the signedness of the operands of mulh
+#define MULH_RS1 1
+#define MULH_RS2 2
+
+static const JitOp ops[] = {
+  { "lui", OP_LUI }, { "auipc", OP_AUIPC }, { "jal", OP_JAL }, { "jalr", OP_JALR },
+  { "beq", OP_BRANCH, CC_E }, { "bne", OP_BRANCH, CC_NE }, { "blt", OP_BRANCH, CC_L },
+  { "bge", OP_BRANCH, CC_GE }, { "bltu", OP_BRANCH, CC_B }, { "bgeu", OP_BRANCH, CC_AE },
+  { "lb", OP_LOAD, 1, true }, { "lh", OP_LOAD, 2, true }, { "lw", OP_LOAD, 4 },
+  { "lbu", OP_LOAD, 1 }, { "lhu", OP_LOAD, 2 },
+  { "sb", OP_STORE, 1 }, { "sh", OP_STORE, 2 }, { "sw", OP_STORE, 4 },
+  { "addi", OP_ALUI, ALU_ADD }, { "xori", OP_ALUI, ALU_XOR },
+  { "ori", OP_ALUI, ALU_OR }, { "andi", OP_ALUI, ALU_AND },
+  { "slti", OP_SLTI, CC_L }, { "sltiu", OP_SLTI, CC_B },
+  { "slli", OP_SHIFTI, SH_SHL }, { "srli", OP_SHIFTI, SH_SHR }, { "srai", OP_SHIFTI, SH_SAR },
+  { "add", OP_ALU, ALU_ADD }, { "sub", OP_ALU, ALU_SUB }, { "xor", OP_ALU, ALU_XOR },
+  { "or", OP_ALU, ALU_OR }, { "and", OP_ALU, ALU_AND },
+  { "slt", OP_SLT, CC_L }, { "sltu", OP_SLT, CC_B },
+  { "sll", OP_SHIFT, SH_SHL }, { "srl", OP_SHIFT, SH_SHR }, { "sra", OP_SHIFT, SH_SAR },
+  { "mul", OP_MUL }, { "mulh", OP_MULH, MULH_RS1 | MULH_RS2 },
+  { "mulhsu", OP_MULH, MULH_RS1 }, { "mulhu", OP_MULH, 0 },
+  { "div", OP_DIV, 0, true }, { "divu", OP_DIV, 0 }, { "rem", OP_DIV, 1, true }, { "remu", OP_DIV, 1 },
+};
+
+static const JitOp* find_op(const char *name) {
+  for (int i = 0; i < ARRLEN(ops); i ++) {
+    if (strcmp(ops[i].name, name) == 0) return &ops[i];
+  }
+  return NULL;
+}
+
+static inline bool is_jump(const JitOp *op) {
+  return op->type == OP_JAL || op->type == OP_JALR || op->type == OP_BRANCH;
+}
+
+#define RD(i)  BITS(i, 11, 7)
+#define RS1(i) BITS(i, 19, 15)
+#define RS2(i) BITS(i, 24, 20)
+#define immI(i) ((word_t)SEXT(BITS(i, 31, 20), 12))
+#define immU(i) ((word_t)SEXT(BITS(i, 31, 12), 20) << 12)
+#define immS(i) (((word_t)SEXT(BITS(i, 31, 25), 7) << 5) | BITS(i, 11, 7))
+#define immB(i) (((word_t)SEXT(BITS(i, 31, 31), 1) << 12) | (BITS(i, 7, 7) << 11) | \
+    (BITS(i, 30, 25) << 5) | (BITS(i, 11, 8) << 1))
+#define immJ(i) (((word_t)SEXT(BITS(i, 31, 31), 1) << 20) | (BITS(i, 19, 12) << 12) | \
+    (BITS(i, 20, 20) << 11) | (BITS(i, 30, 21) << 1))
+
+#define GPR(r) X86_MEM(R15, offsetof(CPU_state, gpr) + (r) * sizeof(word_t))
+#define PC     X86_MEM(R15, offsetof(CPU_state, pc))
+#define FRAME(off) X86_MEM(RSP, off)
+
+// r12 to r15 are kept by the entry for all translated code
+static const int cache_regs[] = { RBX, RBP, RSI, RDI, R8, R9, R10, R11 };
+
+static struct {
+  JitBlock *block; // the block translated
+  int8_t host[32]; // host register caching the guest register, -1 if not cached
+  uint32_t dirty;  // cached guest registers not written back
+} ctx;
+
+// slow path of a memory access, emitted after the block
+typedef struct {
+  uint8_t *rel[5];  // jumps to the slow path
+  uint8_t *resume;  // where a store continues
+  uint32_t dirty;
+  vaddr_t pc;
+  int idx, len, rd;
+  bool sign, store;
+} Stub;
+
+static Stub stubs[JIT_MAX_INST];
+static int nr_stub;
+
+bool jit_fusion = true;
+uint64_t jit_nr_fused = 0;
+
+static inline bool callee_saved(int h) {
+  return h == RBX || h == RBP || h >= R12;
+}
+
+static X86Opnd gpr_opnd(int r) {
+  return ctx.host[r] >= 0 ? X86_REG(ctx.host[r]) : GPR(r);
+}
+
+// load guest register `r' to host register `h'
+static void load_gpr(int h, int r) {
+  if (r == 0) x86_alu_r_rm(ALU_XOR, h, X86_REG(h));
+  else if (ctx.host[r] != h) x86_mov_r_rm(h, gpr_opnd(r));
+}
+
+// guest register `r' as a source operand, with $zero materialized in `tmp'
+static X86Opnd src_opnd(int r, int tmp) {
+  if (r != 0) return gpr_opnd(r);
+  x86_alu_r_rm(ALU_XOR, tmp, X86_REG(tmp));
+  return X86_REG(tmp);
+}
+
+static void store_gpr(int r, int h) {
+  if (r == 0) return;
+  if (ctx.host[r] < 0) { x86_mov_rm_r(GPR(r), h); return; }
+  if (ctx.host[r] != h) x86_mov_r_rm(ctx.host[r], X86_REG(h));
+  ctx.dirty |= 1u << r;
+}
+
+static void store_imm(int r, word_t imm) {
+  if (r == 0) return;
+  if (ctx.host[r] < 0) { x86_mov_rm_imm(GPR(r), imm); return; }
+  x86_mov_r_imm(ctx.host[r], imm);
+  ctx.dirty |= 1u << r;
+}
+
+static void spill(uint32_t dirty) {
+  for (int r = 1; r < 32; r ++) {
+    if (dirty >> r & 1) x86_mov_rm_r(GPR(r), ctx.host[r]);
+  }
+}
+
+// Return to jit_exec() with `nr' more instructions executed. The pc is
+// set by the caller.
+static void emit_leave(int nr, int reason) {
+  if (nr > 0) x86_alu_rm_imm(X86_W, ALU_SUB, FRAME(JIT_FRAME_LEFT), nr);
+  x86_mov_r_imm(RDX, reason);
+  x86_jmp_to(jit_exit);
+}
+
+// Jump to `npc' with `nr' instructions of the block executed. The jump
+// falls through to the exit until jit_exec() chains it to the block there.
+static void emit_jump(vaddr_t npc, int nr) {
+  spill(ctx.dirty);
+  x86_alu_rm_imm(X86_W, ALU_SUB, FRAME(JIT_FRAME_LEFT), nr);
+  uint8_t *rel = x86_jmp();
+  x86_patch(rel, x86_ptr);
+  x86_mov_rm_imm(PC, npc);
+  x86_mov64_r_imm(RDX, (uintptr_t)jit_new_link(ctx.block, rel));
+  x86_jmp_to(jit_exit);
+}
+
+static inline bool is_link(int r) {
+  return r == 1 || r == 5;
+}
+
+static_assert(sizeof(jit_ras.e[0]) == 16, "entries of jit_ras are indexed by shifting");
+static_assert(sizeof(JitJump) == 16, "entries of jit_jcache are indexed by scaling");
+
+// push the return address of a call with the block there, by rcx and rdx
+static void emit_ras_push(vaddr_t ret) {
+  x86_mov64_r_imm(RDX, (uintptr_t)&jit_ras);
+  x86_mov_r_rm(RCX, X86_MEM(RDX, offsetof(JitRas, top)));
+  x86_alu_rm_imm(0, ALU_ADD, X86_REG(RCX), 1);
+  x86_alu_rm_imm(0, ALU_AND, X86_REG(RCX), NR_RAS - 1);
+  x86_mov_rm_r(X86_MEM(RDX, offsetof(JitRas, top)), RCX);
+  x86_shift_imm(X86_W, SH_SHL, X86_REG(RCX), 4);
+  x86_alu64_r_rm(ALU_ADD, RDX, X86_REG(RCX));
+  x86_mov_rm_imm(X86_MEM(RDX, offsetof(JitRas, e[0].pc)), ret);
+  x86_mov64_r_imm(RCX, (uintptr_t)jit_lookup(ret));
+  x86_mov64_rm_r(X86_MEM(RDX, offsetof(JitRas, e[0].b)), RCX);
+}
+
+// Pop the return address stack, and jump to the block there if it is the
+// target in rax. Return the jumps taken on a misprediction.
+static void emit_ras_pop(uint8_t **miss) {
+  x86_mov64_r_imm(RDX, (uintptr_t)&jit_ras);
+  x86_mov_r_rm(RCX, X86_MEM(RDX, offsetof(JitRas, top)));
+  x86_mov_r_rm(RSI, X86_REG(RCX));
+  x86_alu_rm_imm(0, ALU_SUB, X86_REG(RSI), 1);
+  x86_alu_rm_imm(0, ALU_AND, X86_REG(RSI), NR_RAS - 1);
+  x86_mov_rm_r(X86_MEM(RDX, offsetof(JitRas, top)), RSI);
+  x86_shift_imm(X86_W, SH_SHL, X86_REG(RCX), 4);
+  x86_alu64_r_rm(ALU_ADD, RDX, X86_REG(RCX));
+  x86_alu_r_rm(ALU_CMP, RAX, X86_MEM(RDX, offsetof(JitRas, e[0].pc)));
+  miss[0] = x86_jcc(CC_NE);
+  x86_mov64_r_rm(RDX, X86_MEM(RDX, offsetof(JitRas, e[0].b)));
+  x86_mov64_r_rm(RDX, X86_MEM(RDX, offsetof(JitBlock, entry)));
+  x86_alu_rm_imm(X86_W, ALU_CMP, X86_REG(RDX), 0);
+  miss[1] = x86_jcc(CC_E);
+  x86_mov64_r_imm(RCX, (uintptr_t)&jit_ras.nr_hit);
+  x86_alu_rm_imm(X86_W, ALU_ADD, X86_MEM(RCX, 0), 1);
+  x86_jmp_r(RDX);
+}
+
+// Jump to the target in rax with `nr' instructions of the block executed.
+static void emit_indirect(int rd, int rs1, int nr) {
+  spill(ctx.dirty);
+  x86_alu_rm_imm(X86_W, ALU_SUB, FRAME(JIT_FRAME_LEFT), nr);
+  uint8_t *miss[2] = {};
+  if (is_link(rs1) && !is_link(rd)) emit_ras_pop(miss);
+  for (int i = 0; i < 2; i ++) {
+    if (miss[i] != NULL) x86_patch(miss[i], x86_ptr);
+  }
+
+  x86_mov64_r_imm(RDX, (uintptr_t)jit_jcache);
+  x86_mov_r_rm(RCX, X86_REG(RAX));
+  // (pc / 4 % NR_JCACHE) * sizeof(JitJump) = rcx * 4
+  x86_alu_rm_imm(0, ALU_AND, X86_REG(RCX), (NR_JCACHE - 1) * 4);
+  x86_alu_r_rm(ALU_CMP, RAX, X86_MEM_IDX_DISP(RDX, RCX, 4, offsetof(JitJump, pc)));
+  uint8_t *not_found = x86_jcc(CC_NE);
+  x86_jmp_rm(X86_MEM_IDX_DISP(RDX, RCX, 4, offsetof(JitJump, entry)));
+  x86_patch(not_found, x86_ptr);
+  x86_mov_rm_r(PC, RAX);
+  emit_leave(0, JIT_EXIT_INDIRECT);
+}
+
+static Stub* new_stub(vaddr_t pc, int idx, int len, bool store) {
+  Stub *st = &stubs[nr_stub ++];
+  *st = (Stub) { .dirty = ctx.dirty, .pc = pc, .idx = idx, .len = len, .store = store };
+  return st;
+}
+
+// The fast path accesses pmem directly. Other accesses go to the slow
+// path, as well as stores to a page with decoded instructions, which may
+// invalidate the block itself, and stores to a clean page, which should be
+// marked dirty.
+static void emit_load(vaddr_t pc, int idx, int rd, int rs1, word_t imm, int len, bool sign) {
+  load_gpr(RCX, rs1);
+  if (imm != CONFIG_MBASE) x86_alu_rm_imm(0, ALU_ADD, X86_REG(RCX), imm - CONFIG_MBASE);
+  x86_alu_rm_imm(0, ALU_CMP, X86_REG(RCX), CONFIG_MSIZE);
+  Stub *st = new_stub(pc, idx, len, false);
+  st->rd = rd;
+  st->sign = sign;
+  st->rel[0] = x86_jcc(CC_AE);
+  x86_load(RDX, X86_MEM_IDX(R14, RCX, 1), len, sign);
+  store_gpr(rd, RDX);
+}
+
+static void emit_store(vaddr_t pc, int idx, int rs1, int rs2, word_t imm, int len) {
+  load_gpr(RCX, rs1);
+  if (imm != CONFIG_MBASE) x86_alu_rm_imm(0, ALU_ADD, X86_REG(RCX), imm - CONFIG_MBASE);
+  load_gpr(RDX, rs2);
+  x86_alu_rm_imm(0, ALU_CMP, X86_REG(RCX), CONFIG_MSIZE);
+  Stub *st = new_stub(pc, idx, len, true);
+  st->rel[0] = x86_jcc(CC_AE);
+  // check the pages of both ends of the access
+  for (int i = 0; i < (len > 1 ? 2 : 1); i ++) {
+    x86_mov_r_rm(RAX, X86_REG(RCX));
+    if (i == 1) x86_alu_rm_imm(0, ALU_ADD, X86_REG(RAX), len - 1);
+    x86_shift_imm(0, SH_SHR, X86_REG(RAX), PAGE_SHIFT);
+    x86_alu_rm_imm(X86_16, ALU_CMP, X86_MEM_IDX(R13, RAX, 2), 0);
+    st->rel[1 + i * 2] = x86_jcc(CC_NE);
+    x86_bt_rm_r(X86_MEM(R12, 0), RAX);
+    st->rel[2 + i * 2] = x86_jcc(CC_AE);
+  }
+  x86_store(X86_MEM_IDX(R14, RCX, 1), RDX, len);
+  st->resume = x86_ptr;
+}
+
+// An access to MMIO is always the first instruction run by jit_exec(),
+// and ends the run. Then difftest can skip it alone as the interpreter does.
+static void emit_stub(Stub *st) {
+  for (int i = 0; i < ARRLEN(st->rel); i ++) {
+    if (st->rel[i] != NULL) x86_patch(st->rel[i], x86_ptr);
+  }
+  spill(st->dirty);
+  x86_mov_rm_imm(PC, st->pc);
+  uint8_t *chained = NULL;
+  if (st->idx == 0) {
+    // instructions are executed before if the block is entered by chaining
+    x86_mov64_r_rm(RAX, FRAME(JIT_FRAME_LEFT));
+    x86_alu64_r_rm(ALU_CMP, RAX, FRAME(JIT_FRAME_BUDGET));
+    chained = x86_jcc(CC_NE);
+  } else if (!st->store) {
+    emit_leave(st->idx, JIT_EXIT_OTHER);
+    return;
+  }
+
+  x86_mov_r_rm(RDI, X86_REG(RCX));
+  x86_alu_rm_imm(0, ALU_ADD, X86_REG(RDI), CONFIG_MBASE);
+  x86_mov_r_imm(RSI, st->len);
+  if (!st->store) {
+    x86_mov_r_imm(RDX, st->rd);
+    x86_mov_r_imm(RCX, st->sign);
+    x86_call(jit_load);
+  } else {
+    x86_mov_r_imm(RCX, st->idx);
+    x86_call(jit_store);
+    x86_alu_rm_imm(0, ALU_CMP, X86_REG(RAX), JIT_STORE_EXIT);
+    uint8_t *skipped = x86_jcc(CC_B);
+    uint8_t *done = x86_jcc(CC_E);
+    // JIT_STORE_CONTINUE, the helper may clobber caller-saved registers
+    for (int r = 1; r < 32; r ++) {
+      if (ctx.host[r] >= 0 && !callee_saved(ctx.host[r])) x86_mov_r_rm(ctx.host[r], GPR(r));
+    }
+    x86_jmp_to(st->resume);
+    x86_patch(skipped, x86_ptr);
+    emit_leave(st->idx, JIT_EXIT_OTHER);
+    x86_patch(done, x86_ptr);
+  }
+  x86_mov_rm_imm(PC, st->pc + 4);
+  emit_leave(st->idx + 1, JIT_EXIT_OTHER);
+  if (chained != NULL) {
+    x86_patch(chained, x86_ptr);
+    emit_leave(0, JIT_EXIT_OTHER);
+  }
+}
+
+static void emit_div(bool sign, bool rem) {
+  x86_test_r_r(RCX, RCX);
+  uint8_t *zero = x86_jcc(CC_E);
+  uint8_t *overflow = NULL;
+  if (sign) {
+    x86_alu_rm_imm(0, ALU_CMP, X86_REG(RCX), -1);
+    uint8_t *normal = x86_jcc(CC_NE);
+    x86_alu_rm_imm(0, ALU_CMP, X86_REG(RAX), INT32_MIN);
+    uint8_t *normal2 = x86_jcc(CC_NE);
+    // INT32_MIN / -1 = INT32_MIN, INT32_MIN % -1 = 0
+    if (rem) x86_alu_r_rm(ALU_XOR, RAX, X86_REG(RAX));
+    overflow = x86_jmp();
+    x86_patch(normal, x86_ptr);
+    x86_patch(normal2, x86_ptr);
+    x86_cdq();
+    x86_idiv(X86_REG(RCX));
+  } else {
+    x86_alu_r_rm(ALU_XOR, RDX, X86_REG(RDX));
+    x86_div(X86_REG(RCX));
+  }
+  if (rem) x86_mov_r_rm(RAX, X86_REG(RDX));
+  uint8_t *done = x86_jmp();
+  // x / 0 = -1, x % 0 = x
+  x86_patch(zero, x86_ptr);
+  if (!rem) x86_mov_r_imm(RAX, -1);
+  x86_patch(done, x86_ptr);
+  if (overflow != NULL) x86_patch(overflow, x86_ptr);
+}
+
+static void translate_inst(const JitOp *op, uint32_t i, vaddr_t pc, int idx) {
+  int rd = RD(i), rs1 = RS1(i), rs2 = RS2(i);
+  switch (op->type) {
+    case OP_LUI: store_imm(rd, immU(i)); break;
+    case OP_AUIPC: store_imm(rd, pc + immU(i)); break;
+    case OP_JAL:
+      store_imm(rd, pc + 4);
+      if (is_link(rd)) emit_ras_push(pc + 4);
+      emit_jump(pc + immJ(i), idx + 1);
+      break;
+    case OP_JALR:
+      load_gpr(RAX, rs1);
+      x86_alu_rm_imm(0, ALU_ADD, X86_REG(RAX), immI(i));
+      x86_alu_rm_imm(0, ALU_AND, X86_REG(RAX), ~1);
+      store_imm(rd, pc + 4);
+      if (is_link(rd)) emit_ras_push(pc + 4);
+      emit_indirect(rd, rs1, idx + 1);
+      break;
+    case OP_BRANCH: {
+      load_gpr(RAX, rs1);
+      x86_alu_r_rm(ALU_CMP, RAX, src_opnd(rs2, RCX));
+      uint8_t *taken = x86_jcc(op->arg);
+      emit_jump(pc + 4, idx + 1);
+      x86_patch(taken, x86_ptr);
+      emit_jump(pc + immB(i), idx + 1);
+      break;
+    }
+    case OP_LOAD: emit_load(pc, idx, rd, rs1, immI(i), op->arg, op->sign); break;
+    case OP_STORE: emit_store(pc, idx, rs1, rs2, immS(i), op->arg); break;
+    case OP_ALUI:
+      if (rs1 == 0) {
+        word_t imm = immI(i);
+        store_imm(rd, op->arg == ALU_AND ? 0 : imm); // 0 + imm = 0 ^ imm = 0 | imm
+        break;
+      }
+      load_gpr(RAX, rs1);
+      x86_alu_rm_imm(0, op->arg, X86_REG(RAX), immI(i));
+      store_gpr(rd, RAX);
+      break;
+    case OP_SLTI:
+      load_gpr(RAX, rs1);
+      x86_alu_rm_imm(0, ALU_CMP, X86_REG(RAX), immI(i));
+      x86_setcc(op->arg, RAX);
+      x86_load(RAX, X86_REG(RAX), 1, false);
+      store_gpr(rd, RAX);
+      break;
+    case OP_SHIFTI:
+      load_gpr(RAX, rs1);
+      x86_shift_imm(0, op->arg, X86_REG(RAX), rs2);
+      store_gpr(rd, RAX);
+      break;
+    case OP_ALU:
+      load_gpr(RAX, rs1);
+      x86_alu_r_rm(op->arg, RAX, src_opnd(rs2, RCX));
+      store_gpr(rd, RAX);
+      break;
+    case OP_SLT:
+      load_gpr(RAX, rs1);
+      x86_alu_r_rm(ALU_CMP, RAX, src_opnd(rs2, RCX));
+      x86_setcc(op->arg, RAX);
+      x86_load(RAX, X86_REG(RAX), 1, false);
+      store_gpr(rd, RAX);
+      break;
+    case OP_SHIFT:
+      load_gpr(RAX, rs1);
+      load_gpr(RCX, rs2);
+      x86_shift_cl(op->arg, X86_REG(RAX));
+      store_gpr(rd, RAX);
+      break;
+    case OP_MUL:
+      load_gpr(RAX, rs1);
+      x86_imul_r_rm(0, RAX, src_opnd(rs2, RCX));
+      store_gpr(rd, RAX);
+      break;
+    case OP_MULH:
+      // 32-bit moves zero-extend, and the 64-bit product is exact
+      load_gpr(RAX, rs1);
+      load_gpr(RDX, rs2);
+      if (op->arg & MULH_RS1) x86_movsxd(RAX, X86_REG(RAX));
+      if (op->arg & MULH_RS2) x86_movsxd(RDX, X86_REG(RDX));
+      x86_imul_r_rm(X86_W, RAX, X86_REG(RDX));
+      x86_shift_imm(X86_W, SH_SHR, X86_REG(RAX), 32);
+      store_gpr(rd, RAX);
+      break;
+    case OP_DIV:
+      load_gpr(RAX, rs1);
+      load_gpr(RCX, rs2);
+      emit_div(op->sign, op->arg);
+      store_gpr(rd, RAX);
+      break;
+    default: panic("unknown operation %d", op->type);
+  }
+}
+
+// Translate a common pair of instructions as one operation, and return
+// false if they are not such a pair:
+//   lui + addi, auipc + load: the result or the address is a constant
+//   auipc + jalr: the jump is direct, so it can be chained
+//   slt[i][u] + beqz/bnez: branch on the flags of the comparison
+// The destinations of both instructions are written, so the state after
+// the pair is the same as running them one by one. Instructions of a pair
+// are never split by an exit.
+static bool translate_pair(const JitOp **op, const uint32_t *inst, vaddr_t pc, int idx) {
+  uint32_t i0 = inst[0], i1 = inst[1];
+  int rd = RD(i0), rd1 = RD(i1);
+  if (rd == 0 || RS1(i1) != rd) return false;
+  switch (op[0]->type) {
+    case OP_LUI:
+      if (op[1]->type != OP_ALUI || op[1]->arg != ALU_ADD) return false;
+      if (rd1 != rd) store_imm(rd, immU(i0));
+      store_imm(rd1, immU(i0) + immI(i1));
+      return true;
+    case OP_AUIPC:
+      if (op[1]->type == OP_JALR) {
+        // returns pop the return address stack in translate_inst()
+        if (!is_link(rd1) && is_link(rd)) return false;
+        if (rd1 != rd) store_imm(rd, pc + immU(i0));
+        store_imm(rd1, pc + 8);
+        if (is_link(rd1)) emit_ras_push(pc + 8);
+        emit_jump((pc + immU(i0) + immI(i1)) & ~1, idx + 2);
+        return true;
+      }
+      if (op[1]->type == OP_LOAD) {
+        // MMIO is left to the slow path
+        paddr_t addr = pc + immU(i0) + immI(i1);
+        if (!in_pmem(addr) || !in_pmem(addr + op[1]->arg - 1)) return false;
+        if (rd1 != rd) store_imm(rd, pc + immU(i0));
+        x86_load(RDX, X86_MEM(R14, addr - CONFIG_MBASE), op[1]->arg, op[1]->sign);
+        store_gpr(rd1, RDX);
+        return true;
+      }
+      return false;
+    case OP_SLT: case OP_SLTI: {
+      if (op[1]->type != OP_BRANCH || RS2(i1) != 0) return false;
+      if (op[1]->arg != CC_E && op[1]->arg != CC_NE) return false;
+      load_gpr(RAX, RS1(i0));
+      if (op[0]->type == OP_SLT) x86_alu_r_rm(ALU_CMP, RAX, src_opnd(RS2(i0), RCX));
+      else x86_alu_rm_imm(0, ALU_CMP, X86_REG(RAX), immI(i0));
+      // neither the result nor the spills change the flags
+      x86_setcc(op[0]->arg, RAX);
+      x86_load(RAX, X86_REG(RAX), 1, false);
+      store_gpr(rd, RAX);
+      // inverting the condition code of x86 flips its lowest bit
+      uint8_t *taken = x86_jcc(op[1]->arg == CC_NE ? op[0]->arg : op[0]->arg ^ 1);
+      emit_jump(pc + 8, idx + 2);
+      x86_patch(taken, x86_ptr);
+      emit_jump(pc + 4 + immB(i1), idx + 2);
+      return true;
+    }
+    default: return false;
+  }
+}
+
+// count the uses of guest registers to choose the ones to cache
+static void count_regs(const JitOp *op, uint32_t i, int *cnt) {
+  switch (op->type) {
+    case OP_LUI: case OP_AUIPC: case OP_JAL: cnt[RD(i)] ++; break;
+    case OP_JALR: case OP_LOAD: case OP_ALUI: case OP_SLTI: case OP_SHIFTI:
+      cnt[RD(i)] ++; cnt[RS1(i)] ++; break;
+    case OP_BRANCH: case OP_STORE: cnt[RS1(i)] ++; cnt[RS2(i)] ++; break;
+    default: cnt[RD(i)] ++; cnt[RS1(i)] ++; cnt[RS2(i)] ++; break;
+  }
+}
+
+static void alloc_regs(const JitOp **op, const uint32_t *inst, int n) {
+  int cnt[32] = {};
+  for (int k = 0; k < n; k ++) count_regs(op[k], inst[k], cnt);
+  cnt[0] = 0;
+  memset(ctx.host, -1, sizeof(ctx.host));
+  ctx.dirty = 0;
+  for (int h = 0; h < ARRLEN(cache_regs); h ++) {
+    int best = 0;
+    for (int r = 1; r < 32; r ++) {
+      if (ctx.host[r] < 0 && cnt[r] > cnt[best]) best = r;
+    }
+    // a register used only once is not worth loading in advance
+    if (cnt[best] < 2) break;
+    ctx.host[best] = cache_regs[h];
+    x86_mov_r_rm(cache_regs[h], GPR(best));
+  }
+}
+
+bool jit_translate(JitBlock *b) {
+  DecodeEntry *de = dcache_lookup(b->pc);
+  if (de->handler == NULL) return false;
+
+  const JitOp *op[JIT_MAX_INST];
+  uint32_t inst[JIT_MAX_INST];
+  int n = 0;
+  while (n < JIT_MAX_INST && de[n].handler != NULL) {
+    op[n] = find_op(de[n].name);
+    if (op[n] == NULL) break;
+    inst[n] = de[n].inst;
+    if (is_jump(op[n ++])) break;
+  }
+
+  uint8_t *start = x86_ptr;
+  if (n == 0) {
+    // the instruction may stop the simulation, so other blocks are not chained to it
+    b->code = x86_ptr;
+    b->entry = NULL;
+    x86_mov_r_imm(RDI, b->pc);
+    x86_call(jit_interp);
+    emit_leave(1, JIT_EXIT_OTHER);
+    b->nr_inst = 1;
+    return true;
+  }
+
+  // enter from other blocks only if the budget allows the whole block
+  b->entry = x86_ptr;
+  x86_alu_rm_imm(X86_W, ALU_CMP, FRAME(JIT_FRAME_LEFT), n);
+  uint8_t *over_budget = x86_jcc(CC_B);
+  x86_alu_rm_imm(X86_W, ALU_ADD, FRAME(JIT_FRAME_CHAIN), 1);
+  b->code = x86_ptr;
+
+  nr_stub = 0;
+  ctx.block = b;
+  alloc_regs(op, inst, n);
+  for (int k = 0; k < n; k ++) {
+    if (jit_fusion && k + 1 < n && translate_pair(&op[k], &inst[k], b->pc + k * 4, k)) {
+      jit_nr_fused ++;
+      k ++;
+      continue;
+    }
+    translate_inst(op[k], inst[k], b->pc + k * 4, k);
+  }
+  if (!is_jump(op[n - 1])) emit_jump(b->pc + n * 4, n);
+  for (int k = 0; k < nr_stub; k ++) emit_stub(&stubs[k]);
+  x86_patch(over_budget, x86_ptr);
+  x86_mov_rm_imm(PC, b->pc);
+  emit_leave(0, JIT_EXIT_BUDGET);
+  Assert(x86_ptr - start <= JIT_MAX_CODE, "block at " FMT_WORD " is too large", b->pc);
+  b->nr_inst = n;
+  return true;
+}
@@ -15,3 +15,17 @@
 
 INC_PATH += $(NEMU_HOME)/src/isa/$(GUEST_ISA)/include
 DIRS-y += src/isa/$(GUEST_ISA)
+
+ifdef CONFIG_INSTPAT_TREE
+GEN_DECODE_PATH := $(NEMU_HOME)/tools/gen-decode
+GEN_DECODE := $(GEN_DECODE_PATH)/build/gen-decode
+INSTPAT_TREE_H := $(NEMU_HOME)/include/generated/instpat-tree.h
+GEN_HEADERS += $(INSTPAT_TREE_H)
+
+$(GEN_DECODE):
+	$(Q)$(MAKE) $(silent) -C $(GEN_DECODE_PATH)
+
+$(INSTPAT_TREE_H): src/isa/$(GUEST_ISA)/inst.c $(NEMU_HOME)/include/config/auto.conf | $(GEN_DECODE)
+	@echo + GEN $<
+	@$(GEN_DECODE) -o $@ $<
+endif
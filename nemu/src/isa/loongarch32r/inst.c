@@ -19,15 +19,13 @@
 #include <cpu/decode.h>
 
 #define R(i) gpr(i)
-#define Mr vaddr_read
-#define Mw vaddr_write
 
 enum {
   TYPE_2RI12, TYPE_1RI20,
   TYPE_N, // none
 };
 
-#define src1R()  do { *src1 = R(rj); } while (0)
+#define src1R()  do { *src1 = R(rj); IFDEF(CONFIG_DCACHE, s->de->rs1 = rj); } while (0)
 #define simm12() do { *imm = SEXT(BITS(i, 21, 10), 12); } while (0)
 #define simm20() do { *imm = SEXT(BITS(i, 24, 5), 20) << 12; } while (0)
 
@@ -49,13 +47,13 @@ static int decode_exec(Decode *s) {
 #define INSTPAT_INST(s) ((s)->isa.inst.val)
 #define INSTPAT_MATCH(s, name, type, ... /* execute body */ ) { \
   decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type)); \
-  __VA_ARGS__ ; \
+  INSTPAT_EXEC(s, name, __VA_ARGS__); \
 }
 
   INSTPAT_START();
   INSTPAT("0001110 ????? ????? ????? ????? ?????" , pcaddu12i, 1RI20 , R(rd) = s->pc + imm);
-  INSTPAT("0010100010 ???????????? ????? ?????"   , ld.w     , 2RI12 , R(rd) = Mr(src1 + imm, 4));
-  INSTPAT("0010100110 ???????????? ????? ?????"   , st.w     , 2RI12 , Mw(src1 + imm, 4, R(rd)));
+  INSTPAT("0010100010 ???????????? ????? ?????"   , ld.w     , 2RI12 , R(rd) = vaddr_read_u32(src1 + imm));
+  INSTPAT("0010100110 ???????????? ????? ?????"   , st.w     , 2RI12 , vaddr_write_u32(src1 + imm, R(rd)));
 
   INSTPAT("0000 0000 0010 10100 ????? ????? ?????", break    , N     , NEMUTRAP(s->pc, R(4))); // R(4) is $a0
   INSTPAT("????????????????? ????? ????? ?????"   , inv      , N     , INV(s->pc));
@@ -63,10 +61,12 @@ static int decode_exec(Decode *s) {
 
   R(0) = 0; // reset $zero to 0
 
+  INSTPAT_NEXT(s);
+
   return 0;
 }
 
 int isa_exec_once(Decode *s) {
-  s->isa.inst.val = inst_fetch(&s->snpc, 4);
+  s->isa.inst.val = INSTPAT_CACHED(s) ? dcache_fetch(s) : inst_fetch(&s->snpc, 4);
   return decode_exec(s);
 }
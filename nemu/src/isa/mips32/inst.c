@@ -19,16 +19,14 @@
 #include <cpu/decode.h>
 
 #define R(i) gpr(i)
-#define Mr vaddr_read
-#define Mw vaddr_write
 
 enum {
   TYPE_I, TYPE_U,
   TYPE_N, // none
 };
 
-#define src1R() do { *src1 = R(rs); } while (0)
-#define src2R() do { *src2 = R(rt); } while (0)
+#define src1R() do { *src1 = R(rs); IFDEF(CONFIG_DCACHE, s->de->rs1 = rs); } while (0)
+#define src2R() do { *src2 = R(rt); IFDEF(CONFIG_DCACHE, s->de->rs2 = rt); } while (0)
 #define immI() do { *imm = SEXT(BITS(i, 15, 0), 16); } while(0)
 #define immU() do { *imm = BITS(i, 15, 0); } while(0)
 
@@ -51,13 +49,13 @@ static int decode_exec(Decode *s) {
 #define INSTPAT_INST(s) ((s)->isa.inst.val)
 #define INSTPAT_MATCH(s, name, type, ... /* execute body */ ) { \
   decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type)); \
-  __VA_ARGS__ ; \
+  INSTPAT_EXEC(s, name, __VA_ARGS__); \
 }
 
   INSTPAT_START();
   INSTPAT("001111 ????? ????? ????? ????? ??????", lui    , U, R(rd) = imm << 16);
-  INSTPAT("100011 ????? ????? ????? ????? ??????", lw     , I, R(rd) = Mr(src1 + imm, 4));
-  INSTPAT("101011 ????? ????? ????? ????? ??????", sw     , I, Mw(src1 + imm, 4, R(rd)));
+  INSTPAT("100011 ????? ????? ????? ????? ??????", lw     , I, R(rd) = vaddr_read_u32(src1 + imm));
+  INSTPAT("101011 ????? ????? ????? ????? ??????", sw     , I, vaddr_write_u32(src1 + imm, R(rd)));
 
   INSTPAT("011100 ????? ????? ????? ????? 111111", sdbbp  , N, NEMUTRAP(s->pc, R(2))); // R(2) is $v0;
   INSTPAT("?????? ????? ????? ????? ????? ??????", inv    , N, INV(s->pc));
@@ -65,10 +63,12 @@ static int decode_exec(Decode *s) {
 
   R(0) = 0; // reset $zero to 0
 
+  INSTPAT_NEXT(s);
+
   return 0;
 }
 
 int isa_exec_once(Decode *s) {
-  s->isa.inst.val = inst_fetch(&s->snpc, 4);
+  s->isa.inst.val = INSTPAT_CACHED(s) ? dcache_fetch(s) : inst_fetch(&s->snpc, 4);
   return decode_exec(s);
 }
@@ -13,12 +13,15 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#define _GNU_SOURCE // memfd_create()
 #include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 #include <device/mmio.h>
+#include <cpu/decode.h>
 #include <isa.h>
 
-#if   defined(CONFIG_PMEM_MALLOC)
+#if   defined(CONFIG_PMEM_MALLOC) || defined(CONFIG_PMEM_MMAP)
 static uint8_t *pmem = NULL;
 #else // CONFIG_PMEM_GARRAY
 static uint8_t pmem[CONFIG_MSIZE] PG_ALIGN = {};
@@ -27,6 +30,37 @@ static uint8_t pmem[CONFIG_MSIZE] PG_ALIGN = {};
 uint8_t* guest_to_host(paddr_t paddr) { return pmem + paddr - CONFIG_MBASE; }
 paddr_t host_to_guest(uint8_t *haddr) { return haddr - pmem + CONFIG_MBASE; }
 
+// Pages of pmem written since the bitmap is last fetched. Stores to clean
+// pages are taken by the slow path, which marks them.
+static uint64_t dirty[PMEM_DIRTY_WORDS] = {};
+
+static inline void dirty_mark(paddr_t addr) {
+  uint32_t page = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  uint64_t bit = 1ull << (page % 64);
+  if (likely(dirty[page / 64] & bit)) return;
+  dirty[page / 64] |= bit;
+  // later stores to the page can be taken by the fast path
+  tlb_flush_write(ROUNDDOWN(addr, PAGE_SIZE));
+}
+
+bool paddr_dirty(paddr_t addr) {
+  uint32_t page = (addr - CONFIG_MBASE) >> PAGE_SHIFT;
+  return dirty[page / 64] >> (page % 64) & 1;
+}
+
+const uint64_t* paddr_dirty_bitmap() {
+  return dirty;
+}
+
+void paddr_dirty_fetch_clear(uint64_t *bitmap) {
+  for (int i = 0; i < PMEM_DIRTY_WORDS; i ++) {
+    uint64_t w = __atomic_exchange_n(&dirty[i], 0, __ATOMIC_ACQ_REL);
+    if (bitmap != NULL) bitmap[i] = w;
+  }
+  // stores to all pages should be marked again
+  tlb_flush();
+}
+
 static word_t pmem_read(paddr_t addr, int len) {
   word_t ret = host_read(guest_to_host(addr), len);
   return ret;
@@ -34,6 +68,107 @@ static word_t pmem_read(paddr_t addr, int len) {
 
 static void pmem_write(paddr_t addr, int len, word_t data) {
   host_write(guest_to_host(addr), len, data);
+  dirty_mark(addr);
+  dirty_mark(addr + len - 1);
+  IFDEF(CONFIG_DCACHE, dcache_invalidate(addr, len));
+}
+
+#ifdef CONFIG_PMEM_MMAP
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define HUGE_PAGE_SIZE (2ul << 20)
+
+#ifdef CONFIG_PMEM_LAZY_FILL
+// Chunks of pmem are inaccessible until they are first touched, when the
+// handler of SIGSEGV fills them with the random byte.
+#define FILL_CHUNK MUXDEF(CONFIG_PMEM_THP, HUGE_PAGE_SIZE, 64ul << 10)
+
+static uint8_t fill_byte = 0;
+static struct sigaction old_segv = {};
+
+static void pmem_fault(int sig, siginfo_t *info, void *ucontext) {
+  uint8_t *addr = info->si_addr;
+  if (addr >= pmem && addr < pmem + CONFIG_MSIZE) {
+    uint8_t *chunk = pmem + ROUNDDOWN((addr - pmem), FILL_CHUNK);
+    size_t len = pmem + CONFIG_MSIZE - chunk;
+    if (len > FILL_CHUNK) len = FILL_CHUNK;
+    if (mprotect(chunk, len, PROT_READ | PROT_WRITE) == 0) {
+      // pages mapped are zero at the beginning
+      if (fill_byte != 0) memset(chunk, fill_byte, len);
+      return;
+    }
+  }
+  // not a fault of pmem, which is passed to the previous handler
+  if (old_segv.sa_flags & SA_SIGINFO) old_segv.sa_sigaction(sig, info, ucontext);
+  else if (old_segv.sa_handler != SIG_DFL && old_segv.sa_handler != SIG_IGN) old_segv.sa_handler(sig);
+  else {
+    // the fault is fatal when the instruction is run again
+    signal(SIGSEGV, SIG_DFL);
+  }
+}
+#endif
+
+static int pmem_fd = -1;
+
+static void init_pmem_mmap() {
+  int prot = MUXDEF(CONFIG_PMEM_LAZY_FILL, PROT_NONE, PROT_READ | PROT_WRITE);
+  size_t align = MUXDEF(CONFIG_PMEM_THP, HUGE_PAGE_SIZE, 0);
+  uint8_t *p = mmap(NULL, CONFIG_MSIZE + align, prot,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  Assert(p != MAP_FAILED, "Can not map %ld bytes for pmem", (long)CONFIG_MSIZE);
+  pmem = (uint8_t *)MUXDEF(CONFIG_PMEM_THP, ROUNDUP(p, HUGE_PAGE_SIZE), p);
+#ifdef CONFIG_PMEM_MEMFD
+  // replace the reserved range with the shared mapping of the memfd
+  pmem_fd = memfd_create("nemu-pmem", MFD_CLOEXEC);
+  Assert(pmem_fd >= 0 && ftruncate(pmem_fd, CONFIG_MSIZE) == 0, "Can not create the memfd of pmem");
+  p = mmap(pmem, CONFIG_MSIZE, prot, MAP_SHARED | MAP_FIXED | MAP_NORESERVE, pmem_fd, 0);
+  Assert(p != MAP_FAILED, "Can not map the memfd of pmem");
+  Log("pmem is shared as /proc/%d/fd/%d", getpid(), pmem_fd);
+#endif
+  IFDEF(CONFIG_PMEM_THP, madvise(pmem, CONFIG_MSIZE, MADV_HUGEPAGE));
+#ifdef CONFIG_PMEM_LAZY_FILL
+  fill_byte = rand();
+  struct sigaction s = { .sa_sigaction = pmem_fault, .sa_flags = SA_SIGINFO };
+  sigemptyset(&s.sa_mask);
+  int ret = sigaction(SIGSEGV, &s, &old_segv);
+  Assert(ret == 0, "Can not set the handler of SIGSEGV");
+#endif
+}
+#endif
+
+int paddr_memfd() {
+  return MUXDEF(CONFIG_PMEM_MMAP, pmem_fd, -1);
+}
+
+bool paddr_map_file(paddr_t addr, int fd, size_t size) {
+#ifdef CONFIG_PMEM_MMAP
+  // a private mapping would hide the image from the other users of the memfd
+  if (pmem_fd >= 0) return false;
+  size_t page = sysconf(_SC_PAGESIZE);
+  uint8_t *host = guest_to_host(addr);
+  if (size == 0 || !in_pmem(addr) || size > PMEM_RIGHT - addr + 1 || (uintptr_t)host % page != 0) return false;
+  // fill the chunks at both ends first, whose filling would overwrite the file
+  paddr_touch(addr, 1);
+  paddr_touch(addr + size - 1, 1);
+  size_t len = ROUNDUP(size, page);
+  if (mmap(host, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) return false;
+  // the rest of the last page is zero
+  IFDEF(CONFIG_PMEM_LAZY_FILL, memset(host + size, fill_byte, len - size));
+  return true;
+#else
+  return false;
+#endif
+}
+
+void paddr_touch(paddr_t addr, size_t len) {
+#ifdef CONFIG_PMEM_LAZY_FILL
+  if (len == 0) return;
+  volatile uint8_t *p = guest_to_host(addr);
+  for (size_t i = 0; i < len; i += FILL_CHUNK) (void)p[i];
+  (void)p[len - 1];
+#endif
 }
 
 static void out_of_bound(paddr_t addr) {
@@ -45,13 +180,29 @@ void init_mem() {
 #if   defined(CONFIG_PMEM_MALLOC)
   pmem = malloc(CONFIG_MSIZE);
   assert(pmem);
+#elif defined(CONFIG_PMEM_MMAP)
+  init_pmem_mmap();
 #endif
+  // filling pmem mapped by mmap() would allocate all of its pages
+#ifndef CONFIG_PMEM_MMAP
   IFDEF(CONFIG_MEM_RANDOM, memset(pmem, rand(), CONFIG_MSIZE));
+#endif
+  tlb_flush();
   Log("physical memory area [" FMT_PADDR ", " FMT_PADDR "]", PMEM_LEFT, PMEM_RIGHT);
+  init_regions();
+}
+
+uint8_t* paddr_to_host(paddr_t addr, bool write) {
+  if (likely(in_pmem(addr))) return guest_to_host(addr);
+  const MemRegion *r = region_of(addr);
+  if (r != NULL) return (write && r->rom ? NULL : r->host + (addr - r->base));
+  return MUXDEF(CONFIG_DEVICE, mmio_to_host(addr), NULL);
 }
 
 word_t paddr_read(paddr_t addr, int len) {
   if (likely(in_pmem(addr))) return pmem_read(addr, len);
+  const MemRegion *r = region_of(addr);
+  if (r != NULL) return host_read(r->host + (addr - r->base), len);
   IFDEF(CONFIG_DEVICE, return mmio_read(addr, len));
   out_of_bound(addr);
   return 0;
@@ -59,6 +210,12 @@ word_t paddr_read(paddr_t addr, int len) {
 
 void paddr_write(paddr_t addr, int len, word_t data) {
   if (likely(in_pmem(addr))) { pmem_write(addr, len, data); return; }
+  const MemRegion *r = region_of(addr);
+  if (r != NULL) {
+    if (r->rom) panic("write to ROM %s at address = " FMT_PADDR ", pc = " FMT_WORD, r->name, addr, cpu.pc);
+    host_write(r->host + (addr - r->base), len, data);
+    return;
+  }
   IFDEF(CONFIG_DEVICE, mmio_write(addr, len, data); return);
   out_of_bound(addr);
 }
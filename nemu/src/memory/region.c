@@ -0,0 +1,105 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <memory/paddr.h>
+
+#ifndef CONFIG_TARGET_AM
+
+#define MAX_REGION 16
+#define DIR_SHIFT 22 // each entry of the directory covers 4 MiB
+#define PAGE_SHIFT 12
+
+static MemRegion regions[MAX_REGION] = {};
+static int nr_region = 0;
+// The region of each page, as its index plus one, in tables of pages
+// allocated for the entries of the directory touched by any region.
+static uint8_t *region_dir[1ull << (32 - DIR_SHIFT)] = {};
+
+const MemRegion* region_of(paddr_t addr) {
+  if (MUXDEF(PMEM64, addr >> 32, 0)) return NULL;
+  const uint8_t *table = region_dir[(uint32_t)addr >> DIR_SHIFT];
+  if (likely(table == NULL)) return NULL;
+  int idx = table[((uint32_t)addr >> PAGE_SHIFT) & ((1 << (DIR_SHIFT - PAGE_SHIFT)) - 1)];
+  return (idx == 0 ? NULL : &regions[idx - 1]);
+}
+
+static void map_region(const MemRegion *r) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  uint8_t *host = mmap(NULL, r->size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  Assert(host != MAP_FAILED, "Can not map region %s", r->name);
+  if (r->file != NULL) {
+    int fd = open(r->file, O_RDONLY);
+    Assert(fd >= 0, "Can not open '%s' for region %s", r->file, r->name);
+    struct stat st;
+    Assert(fstat(fd, &st) == 0 && st.st_size <= r->size, "'%s' does not fit in region %s", r->file, r->name);
+    if (st.st_size > 0) {
+      void *p = mmap(host, ROUNDUP(st.st_size, page), PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_FIXED, fd, 0);
+      Assert(p != MAP_FAILED, "Can not map '%s' for region %s", r->file, r->name);
+    }
+    close(fd);
+  }
+  // stray writes of NEMU to a ROM are caught by the host
+  if (r->rom) mprotect(host, r->size, PROT_READ);
+  ((MemRegion *)r)->host = host;
+}
+
+static void add_region(MemRegion r) {
+  Assert(nr_region < MAX_REGION, "Too many regions of memory");
+  Assert(r.size > 0 && r.base % (1 << PAGE_SHIFT) == 0 && r.size % (1 << PAGE_SHIFT) == 0,
+      "Region %s should be aligned to pages", r.name);
+  Assert((uint64_t)r.base + r.size <= 0x100000000ull, "Region %s should be below 4 GiB", r.name);
+  Assert(r.base + r.size - 1 < PMEM_LEFT || r.base > PMEM_RIGHT, "Region %s overlaps pmem", r.name);
+  for (paddr_t a = r.base; a - r.base < r.size; a += (1 << PAGE_SHIFT)) {
+    Assert(region_of(a) == NULL, "Region %s overlaps region %s at " FMT_PADDR, r.name, region_of(a)->name, a);
+    uint8_t **table = &region_dir[(uint32_t)a >> DIR_SHIFT];
+    if (*table == NULL) {
+      *table = calloc(1 << (DIR_SHIFT - PAGE_SHIFT), 1);
+      assert(*table);
+    }
+    (*table)[((uint32_t)a >> PAGE_SHIFT) & ((1 << (DIR_SHIFT - PAGE_SHIFT)) - 1)] = nr_region + 1;
+  }
+  regions[nr_region] = r;
+  map_region(&regions[nr_region]);
+  Log("%s area [" FMT_PADDR ", " FMT_PADDR "]%s%s%s", r.name, r.base, r.base + r.size - 1,
+      (r.rom ? ", read-only" : ""), (r.file ? ", from " : ""), (r.file ? r.file : ""));
+  nr_region ++;
+}
+
+// Parse regions in CONFIG_MEM_REGIONS, e.g. "flash:rom:0x30000000:0x10000000:flash.bin".
+void init_regions() {
+  char *spec = strdup(CONFIG_MEM_REGIONS);
+  assert(spec);
+  char *save = NULL;
+  for (char *s = strtok_r(spec, ",", &save); s != NULL; s = strtok_r(NULL, ",", &save)) {
+    char *field[5] = {};
+    int n = 0;
+    for (char *f = strsep(&s, ":"); f != NULL && n < 5; f = strsep(&s, ":")) field[n ++] = f;
+    Assert(n >= 4 && (strcmp(field[1], "ram") == 0 || strcmp(field[1], "rom") == 0),
+        "Invalid region '%s', which should be NAME:ram|rom:BASE:SIZE[:FILE]", field[0]);
+    add_region((MemRegion) {
+      .name = field[0], .rom = (field[1][1] == 'o'),
+      .base = strtoull(field[2], NULL, 0), .size = strtoull(field[3], NULL, 0),
+      .file = (n == 5 && field[4][0] != '\0' ? field[4] : NULL),
+    });
+  }
+}
+#endif
@@ -15,15 +15,96 @@
 
 #include <isa.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <cpu/decode.h>
+
+TLBEntry tlb[3][TLB_SIZE] = {};
+
+void tlb_flush() {
+  for (int type = 0; type < ARRLEN(tlb); type ++) {
+    for (int i = 0; i < TLB_SIZE; i ++) tlb[type][i].tag = TLB_INVALID;
+  }
+}
+
+void tlb_flush_page(vaddr_t vaddr) {
+  vaddr_t page = vaddr & ~PAGE_MASK;
+  for (int type = 0; type < ARRLEN(tlb); type ++) {
+    TLBEntry *e = &tlb[type][(vaddr >> PAGE_SHIFT) % TLB_SIZE];
+    if ((e->tag & ~TLB_SLOW) == page) e->tag = TLB_INVALID;
+  }
+}
+
+void tlb_flush_write(paddr_t page) {
+  for (int i = 0; i < TLB_SIZE; i ++) {
+    TLBEntry *e = &tlb[MEM_TYPE_WRITE][i];
+    if (e->paddr == page) e->tag = TLB_INVALID;
+  }
+}
+
+// Writes to pmem are taken by the slow path if they should be noticed,
+// e.g. they may overwrite decoded instructions, or the page is clean.
+static inline bool write_noticed(paddr_t page) {
+  return !paddr_dirty(page) || MUXDEF(CONFIG_DCACHE, dcache_page_cached(page), false);
+}
+
+static TLBEntry* tlb_refill(vaddr_t vaddr, int type) {
+  vaddr_t page = vaddr & ~PAGE_MASK;
+  paddr_t paddr = page;
+  if (isa_mmu_check(vaddr, 1, type) != MMU_DIRECT) {
+    // the page frame is returned with MEM_RET_* in the offset
+    paddr = isa_mmu_translate(page, 1, type);
+    if ((paddr & PAGE_MASK) != MEM_RET_OK) {
+      panic("address translation fails at vaddr = " FMT_WORD ", pc = " FMT_WORD, vaddr, cpu.pc);
+    }
+  }
+  uint8_t *host = paddr_to_host(paddr, type == MEM_TYPE_WRITE);
+  bool slow = (host == NULL || (type == MEM_TYPE_WRITE && in_pmem(paddr) && write_noticed(paddr)) ||
+      (unlikely(wp_mem_types & (1 << type)) && wp_mem_page(page, paddr, type)));
+  TLBEntry *e = &tlb[type][(vaddr >> PAGE_SHIFT) % TLB_SIZE];
+  *e = (TLBEntry) {
+    .tag = page | (slow ? TLB_SLOW : 0), .asid = isa_mmu_asid(),
+    .paddr = paddr, .host = (slow ? NULL : host),
+  };
+  return e;
+}
+
+static inline paddr_t translate(vaddr_t vaddr, int len, int type) {
+  TLBEntry *e = &tlb[type][(vaddr >> PAGE_SHIFT) % TLB_SIZE];
+  if (unlikely((e->tag & ~TLB_SLOW) != (vaddr & ~PAGE_MASK) || e->asid != isa_mmu_asid())) {
+    e = tlb_refill(vaddr, type);
+  }
+  paddr_t paddr = e->paddr | (vaddr & PAGE_MASK);
+  if (unlikely(wp_mem_types & (1 << type))) wp_mem_check(vaddr, paddr, len, type);
+  return paddr;
+}
+
+static inline bool cross_page(vaddr_t addr, int len, int type) {
+  return unlikely((addr & PAGE_MASK) + len > PAGE_SIZE) &&
+    isa_mmu_check(addr, len, type) != MMU_DIRECT;
+}
+
+static word_t slow_read(vaddr_t addr, int len, int type) {
+  if (cross_page(addr, len, type)) {
+    // an access across pages is split into bytes, in little endian
+    word_t data = 0;
+    for (int i = 0; i < len; i ++) data |= paddr_read(translate(addr + i, 1, type), 1) << (i * 8);
+    return data;
+  }
+  return paddr_read(translate(addr, len, type), len);
+}
 
 word_t vaddr_ifetch(vaddr_t addr, int len) {
-  return paddr_read(addr, len);
+  return slow_read(addr, len, MEM_TYPE_IFETCH);
 }
 
 word_t vaddr_read(vaddr_t addr, int len) {
-  return paddr_read(addr, len);
+  return slow_read(addr, len, MEM_TYPE_READ);
 }
 
 void vaddr_write(vaddr_t addr, int len, word_t data) {
-  paddr_write(addr, len, data);
+  if (cross_page(addr, len, MEM_TYPE_WRITE)) {
+    for (int i = 0; i < len; i ++) paddr_write(translate(addr + i, 1, MEM_TYPE_WRITE), 1, data >> (i * 8));
+    return;
+  }
+  paddr_write(translate(addr, len, MEM_TYPE_WRITE), len, data);
 }
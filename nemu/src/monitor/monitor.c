@@ -15,12 +15,17 @@
 
 #include <isa.h>
 #include <memory/paddr.h>
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <cpu/jit.h>
+#include <cpu/aot.h>
 
 void init_rand();
 void init_log(const char *log_file);
 void init_mem();
 void init_difftest(char *ref_so_file, long img_size, int port);
 void init_device();
+void device_set_icount(int shift);
 void init_sdb();
 void init_disasm(const char *triple);
 
@@ -38,11 +43,15 @@ static void welcome() {
 #include <getopt.h>
 
 void sdb_set_batch_mode();
+void sdb_watch(char *e);
 
 static char *log_file = NULL;
 static char *diff_so_file = NULL;
 static char *img_file = NULL;
 static int difftest_port = 1234;
+static char *watch_expr[8] = {};
+static int nr_watch = 0;
+static int icount_shift = -1;
 
 static long load_img() {
   if (img_file == NULL) {
@@ -58,9 +67,14 @@ static long load_img() {
 
   Log("The image is %s, size = %ld", img_file, size);
 
-  fseek(fp, 0, SEEK_SET);
-  int ret = fread(guest_to_host(RESET_VECTOR), size, 1, fp);
-  assert(ret == 1);
+  if (paddr_map_file(RESET_VECTOR, fileno(fp), size)) {
+    Log("The image is mapped copy-on-write");
+  } else {
+    fseek(fp, 0, SEEK_SET);
+    paddr_touch(RESET_VECTOR, size);
+    int ret = fread(guest_to_host(RESET_VECTOR), size, 1, fp);
+    assert(ret == 1);
+  }
 
   fclose(fp);
   return size;
@@ -72,16 +86,41 @@ static int parse_args(int argc, char *argv[]) {
     {"log"      , required_argument, NULL, 'l'},
     {"diff"     , required_argument, NULL, 'd'},
     {"port"     , required_argument, NULL, 'p'},
+    {"no-fusion", no_argument      , NULL, 'F'},
+    {"itrace"   , no_argument      , NULL, 'i'},
+    {"watch"    , required_argument, NULL, 'w'},
+    {"aot"      , required_argument, NULL, 'a'},
+    {"tcache"   , required_argument, NULL, 't'},
+    {"icount"   , required_argument, NULL, 'c'},
     {"help"     , no_argument      , NULL, 'h'},
     {0          , 0                , NULL,  0 },
   };
   int o;
-  while ( (o = getopt_long(argc, argv, "-bhl:d:p:", table, NULL)) != -1) {
+  while ( (o = getopt_long(argc, argv, "-bhl:d:p:Fiw:a:t:c:", table, NULL)) != -1) {
     switch (o) {
       case 'b': sdb_set_batch_mode(); break;
       case 'p': sscanf(optarg, "%d", &difftest_port); break;
       case 'l': log_file = optarg; break;
       case 'd': diff_so_file = optarg; break;
+      case 'F': IFDEF(CONFIG_ENGINE_JIT, jit_set_fusion(false)); break;
+      case 'i':
+        if (!cpu_instrument(INSTR_ITRACE, true)) printf("The instruction tracer is not supported by this build\n");
+        break;
+      case 'w':
+        Assert(nr_watch < ARRLEN(watch_expr), "Too many watchpoints on the command line");
+        if (!cpu_instrument(INSTR_WATCHPOINT, true)) printf("Watchpoints are not supported by this build\n");
+        watch_expr[nr_watch ++] = optarg;
+        break;
+      case 'a': IFDEF(CONFIG_ENGINE_AOT, aot_set_dir(optarg)); break;
+      case 't':
+        MUXDEF(CONFIG_TCACHE, tcache_init(optarg), printf("The decode cache is not kept by this build\n"));
+        break;
+      case 'c': {
+        char end;
+        Assert(sscanf(optarg, "%d%c", &icount_shift, &end) == 1 && icount_shift >= 0,
+            "The shift of --icount should be a non-negative number, but it is '%s'", optarg);
+        break;
+      }
       case 1: img_file = optarg; return 0;
       default:
         printf("Usage: %s [OPTION...] IMAGE [args]\n\n", argv[0]);
@@ -89,6 +128,12 @@ static int parse_args(int argc, char *argv[]) {
         printf("\t-l,--log=FILE           output log to FILE\n");
         printf("\t-d,--diff=REF_SO        run DiffTest with reference REF_SO\n");
         printf("\t-p,--port=PORT          run DiffTest with port PORT\n");
+        printf("\t-F,--no-fusion          do not fuse instruction pairs in the JIT\n");
+        printf("\t-i,--itrace             trace instructions from the start\n");
+        printf("\t-w,--watch=EXPR         stop when the value of EXPR changes\n");
+        printf("\t-a,--aot=DIR            cache images translated ahead of time in DIR\n");
+        printf("\t-t,--tcache=DIR         keep decoded instructions across runs in DIR\n");
+        printf("\t-c,--icount=SHIFT       derive the time from instructions, each taking 2^SHIFT ns\n");
         printf("\n");
         exit(0);
     }
@@ -104,6 +149,11 @@ void init_monitor(int argc, char *argv[]) {
 
   /* Set random seed. */
   init_rand();
+  if (icount_shift >= 0) {
+    // runs with icount are reproducible
+    srand(0);
+    MUXDEF(CONFIG_DEVICE, device_set_icount(icount_shift), printf("icount has no effect without devices\n"));
+  }
 
   /* Open the log file. */
   init_log(log_file);
@@ -120,11 +170,15 @@ void init_monitor(int argc, char *argv[]) {
   /* Load the image to memory. This will overwrite the built-in image. */
   long img_size = load_img();
 
+  /* Load the translation of the image, which is translated if not cached. */
+  IFDEF(CONFIG_ENGINE_AOT, aot_load(img_size));
+
   /* Initialize differential testing. */
   init_difftest(diff_so_file, img_size, difftest_port);
 
   /* Initialize the simple debugger. */
   init_sdb();
+  for (int i = 0; i < nr_watch; i ++) sdb_watch(watch_expr[i]);
 
 #ifndef CONFIG_ISA_loongarch32r
   IFDEF(CONFIG_ITRACE, init_disasm(
@@ -28,6 +28,7 @@ void init_regex();
 void init_wp_pool();
 int new_wp(char* expr,bool * success);
 void free_wp(int num , bool * success);
+int new_wp_mem(bool phys, uint64_t addr, uint64_t len, int types, bool *success);
 void wp_display();
 
 /* We use the `readline' library to provide more flexibility to read from stdin. */
@@ -144,6 +145,33 @@ static int cmd_w(char *args) {
   return 0;
 }
 
+static int cmd_wm(char *args) {
+  char *arg = strtok(args, " ");
+  bool phys = (arg != NULL && strcmp(arg, "-p") == 0);
+  if (phys) arg = strtok(NULL, " ");
+  char *len = strtok(NULL, " ");
+  char *types = strtok(NULL, " ");
+  bool success = true;
+  word_t addr = (arg == NULL || len == NULL ? 0 : expr(arg, &success));
+  if (arg == NULL || len == NULL || !success || strtoull(len, NULL, 0) == 0) {
+    printf("Usage: wm [-p] ADDR LEN [rwx]\n");
+    return 0;
+  }
+  int t = 0;
+  for (char *c = (types == NULL ? "w" : types); *c != '\0'; c ++) {
+    switch (*c) {
+      case 'r': t |= 1 << MEM_TYPE_READ; break;
+      case 'w': t |= 1 << MEM_TYPE_WRITE; break;
+      case 'x': t |= 1 << MEM_TYPE_IFETCH; break;
+      default: printf("Unknown type of access '%c'\n", *c); return 0;
+    }
+  }
+  int wid = new_wp_mem(phys, addr, strtoull(len, NULL, 0), t, &success);
+  if (success) printf("Watchpoint %d : %s [" FMT_WORD ", +%s)\n", wid, (phys ? "paddr" : "vaddr"), addr, len);
+  else printf("Could not insert watchpoint!\n");
+  return 0;
+}
+
 static int cmd_d(char *args) {
   if(args != NULL) {
     bool success = true;
@@ -154,6 +182,27 @@ static int cmd_d(char *args) {
   return 0;
 }
 
+static int cmd_set(char *args) {
+  static const struct { const char *name; int what; } instr_table[] = {
+    { "itrace", INSTR_ITRACE }, { "difftest", INSTR_DIFFTEST }, { "watch", INSTR_WATCHPOINT },
+  };
+  char *name = strtok(args, " ");
+  char *val = strtok(NULL, " ");
+  if (name == NULL || val == NULL || (strcmp(val, "on") != 0 && strcmp(val, "off") != 0)) {
+    printf("Usage: set itrace|difftest|watch on|off\n");
+    return 0;
+  }
+  for (int i = 0; i < ARRLEN(instr_table); i ++) {
+    if (strcmp(name, instr_table[i].name) == 0) {
+      if (!cpu_instrument(instr_table[i].what, strcmp(val, "on") == 0)) {
+        printf("'%s' is not supported by this build, enable it in menuconfig\n", name);
+      }
+      return 0;
+    }
+  }
+  printf("Unknown instrumentation '%s'\n", name);
+  return 0;
+}
 
 static int cmd_help(char *args);
 
@@ -170,7 +219,10 @@ static struct {
   { "x","Find the value of the expression EXPR, use the result as the starting memory address, and output N consecutive 4-byte outputs in hexadecimal.",cmd_x},
   { "p", "Calculate the value of the expression EXPR", cmd_p },
   { "w", "Set watchpoint to stop execution whenever the value of the given expression changes", cmd_w },
-  { "d", "Delete the given num  watchpoint", cmd_d } 
+  { "wm", "Set a data watchpoint on LEN bytes at the virtual address ADDR, or the physical one with -p, "
+    "to stop execution after an access of the types given (read, write or execute, 'w' by default): wm [-p] ADDR LEN [rwx]", cmd_wm },
+  { "d", "Delete the given num  watchpoint", cmd_d },
+  { "set", "Switch instrumentation at runtime: set itrace|difftest|watch on|off", cmd_set },
 };
 
 #define NR_CMD ARRLEN(cmd_table)
@@ -198,6 +250,14 @@ static int cmd_help(char *args) {
   return 0;
 }
 
+// set a watchpoint given on the command line
+void sdb_watch(char *e) {
+  bool success = true;
+  int wid = new_wp(e, &success);
+  if (success) Log("Watchpoint %d : %s", wid, e);
+  else Log("Could not insert watchpoint '%s'", e);
+}
+
 void sdb_set_batch_mode() {
   is_batch_mode = true;
 }
@@ -14,6 +14,9 @@
 ***************************************************************************************/
 
 #include "sdb.h"
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <memory/vaddr.h>
 
 #define NR_WP 32
 
@@ -22,13 +25,19 @@ typedef struct watchpoint {
   char expr[128];
   word_t preval;
   int hittime;
+  // a data watchpoint on [addr, addr + len) if types is not 0, which is
+  // checked by the slow path of memory accesses instead of wp_test()
+  int types; // 1 << MEM_TYPE_*
+  bool phys;
+  uint64_t addr, len;
   struct watchpoint *pre;
   struct watchpoint *next;
 } WP;
 
 static WP wp_pool[NR_WP] = {};
+void wp_mem_update();
 static WP *head = NULL, *free_ = NULL ;
-WP Dummyhead = {-1,"NULL",0,0,NULL,NULL};
+WP Dummyhead = { .NO = -1, .expr = "NULL" };
 
 void init_wp_pool() {
   for (int i = 0; i < NR_WP; i ++) {
@@ -46,13 +55,14 @@ void init_wp_pool() {
 
 int new_wp(char* expr,bool * success) {
   if(free_ == NULL)  {
+    printf("No free watchpoint, at most %d watchpoints can be set\n", NR_WP);
     *success = false;
     return 0;
   }
   else *success = true;
   WP* alloc = free_;
   free_ = free_->next;
-  free_->pre = NULL;
+  if(free_ != NULL)free_->pre = NULL;
   alloc->next = Dummyhead.next;
   alloc->pre = &Dummyhead; 
   if(head != NULL)head->pre = alloc;
@@ -78,11 +88,14 @@ void free_wp(int num , bool * success) {
       memset(temp->expr,0, sizeof(temp->expr));
       temp->hittime = 0;
       temp->preval = 0;
+      bool mem = (temp->types != 0);
+      temp->types = 0;
       temp->pre = NULL;
       temp->next = free_;
       if(free_ != NULL)free_->pre = temp;
       free_ = temp; 
       head = Dummyhead.next;
+      if (mem) wp_mem_update();
       return;
     }
     temp = temp->next;
@@ -95,7 +108,11 @@ void wp_display()
   printf("Num \t What \t \n");
   WP*temp = Dummyhead.next; 
   while(temp != NULL){
-    printf("%d\t %s\t \n",temp->NO,temp->expr);
+    if (temp->types != 0) printf("%d\t %s [0x%" PRIx64 ", 0x%" PRIx64 ") %s%s%s\t \n", temp->NO,
+        (temp->phys ? "paddr" : "vaddr"), temp->addr, temp->addr + temp->len,
+        (temp->types & (1 << MEM_TYPE_READ) ? "r" : ""), (temp->types & (1 << MEM_TYPE_WRITE) ? "w" : ""),
+        (temp->types & (1 << MEM_TYPE_IFETCH) ? "x" : ""));
+    else printf("%d\t %s\t \n",temp->NO,temp->expr);
     if(temp->hittime > 0) printf(" breakpoint already hit %d times\n",temp->hittime);
     temp = temp->next;
   }
@@ -105,6 +122,7 @@ bool wp_test() {
   bool flag = false; 
   WP*temp = Dummyhead.next; 
   while(temp != NULL) {
+    if (temp->types != 0) { temp = temp->next; continue; }
     word_t newval = expr(temp->expr,NULL);
     if(newval != temp->preval) {
       flag = true;
@@ -118,4 +136,85 @@ bool wp_test() {
     temp = temp->next;
   }
   return flag;
-}
\ No newline at end of file
+}
+
+// whether any watchpoint should be tested after each instruction
+bool wp_active() {
+  for (WP *p = Dummyhead.next; p != NULL; p = p->next) {
+    if (p->types == 0) return true;
+  }
+  return false;
+}
+
+// --- data watchpoints ---
+#ifdef CONFIG_WATCHPOINT
+int wp_mem_types = 0;
+static bool wp_mem_enabled = true;
+
+// Pages are checked again when they are refilled into the TLB, and when
+// they are decoded if instruction fetches are watched.
+void wp_mem_update() {
+  int old = wp_mem_types;
+  wp_mem_types = 0;
+  for (WP *p = Dummyhead.next; p != NULL && wp_mem_enabled; p = p->next) wp_mem_types |= p->types;
+  tlb_flush();
+  if ((old | wp_mem_types) & (1 << MEM_TYPE_IFETCH)) IFDEF(CONFIG_DCACHE, dcache_flush());
+}
+
+void wp_mem_enable(bool enable) {
+  wp_mem_enabled = enable;
+  wp_mem_update();
+}
+
+int new_wp_mem(bool phys, uint64_t addr, uint64_t len, int types, bool *success) {
+  char desc[64];
+  snprintf(desc, sizeof(desc), "%s 0x%" PRIx64, (phys ? "paddr" : "vaddr"), addr);
+  int no = new_wp(desc, success);
+  if (!*success) return 0;
+  WP *p = &wp_pool[no];
+  p->types = types;
+  p->phys = phys;
+  p->addr = addr;
+  p->len = len;
+  wp_mem_update();
+  return no;
+}
+
+static inline bool overlap(uint64_t a, uint64_t alen, uint64_t b, uint64_t blen) {
+  return a - b < blen || b - a < alen;
+}
+
+bool wp_mem_page(vaddr_t vpage, paddr_t ppage, int type) {
+  for (WP *p = Dummyhead.next; p != NULL; p = p->next) {
+    if ((p->types & (1 << type)) && overlap((p->phys ? ppage : vpage), PAGE_SIZE, p->addr, p->len)) return true;
+  }
+  return false;
+}
+
+void wp_mem_check(vaddr_t vaddr, paddr_t paddr, int len, int type) {
+  static const char *type_name[] = {
+    [MEM_TYPE_IFETCH] = "fetch", [MEM_TYPE_READ] = "read", [MEM_TYPE_WRITE] = "write",
+  };
+  bool hit = false;
+  for (WP *p = Dummyhead.next; p != NULL; p = p->next) {
+    if ((p->types & (1 << type)) && overlap((p->phys ? paddr : vaddr), len, p->addr, p->len)) {
+      printf("Watchpoint %d : %s of %d bytes at vaddr = " FMT_WORD ", paddr = " FMT_PADDR ", pc = " FMT_WORD "\n",
+          p->NO, type_name[type], len, vaddr, paddr, cpu.pc);
+      p->hittime ++;
+      hit = true;
+    }
+  }
+  // stop after the instruction accessing the memory
+  if (hit) {
+    nemu_state.state = NEMU_STOP;
+    cpu_end_run();
+  }
+}
+#else
+void wp_mem_update() {}
+
+int new_wp_mem(bool phys, uint64_t addr, uint64_t len, int types, bool *success) {
+  *success = false;
+  return 0;
+}
+#endif
@@ -0,0 +1,353 @@
+/***************************************************************************************
+* Copyright (c) 2014-2022 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+/* Generate a decision-tree decoder from the INSTPAT list of an ISA.
+ *
+ * The patterns between INSTPAT_START() and INSTPAT_END() are matched in
+ * order, and the first matched one wins. The generated decoder switches on
+ * a bit field of the instruction (e.g. opcode, then funct3, then funct7)
+ * at each level, and returns the index of the first pattern matched by the
+ * instruction, or -1 if no pattern is matched. It is equivalent to the
+ * pattern list by construction, and this can be checked with `-c'.
+ */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <getopt.h>
+
+#define MAX_PAT 1024
+#define MAX_LINE 4096
+// the widest field examined by a switch statement
+#define MAX_FIELD 8
+
+typedef struct {
+  uint32_t mask, val;
+  bool never; // require a bit beyond the 32-bit instruction
+  int line;
+  char name[32];
+} Pattern;
+
+typedef struct Node {
+  int idx;      // index of the matched pattern if leaf, -1 if no match
+  int lo, len;  // the field examined if not leaf
+  struct Node **child;
+} Node;
+
+static Pattern pat[MAX_PAT];
+static int nr_pat = 0;
+static int nr_node = 0, max_depth = 0;
+static const char *src_file = NULL;
+
+static void __attribute__((noreturn)) fail(int line, const char *msg) {
+  fprintf(stderr, "%s:%d: %s\n", src_file, line, msg);
+  exit(1);
+}
+
+// the same as pattern_decode() in include/cpu/decode.h
+static void parse_pattern(Pattern *p, const char *str, int len) {
+  uint64_t key = 0, mask = 0;
+  int nr_bit = 0;
+  for (int i = 0; i < len; i ++) {
+    char c = str[i];
+    if (c == ' ') continue;
+    if (c != '0' && c != '1' && c != '?') fail(p->line, "invalid character in pattern string");
+    if (++ nr_bit > 64) fail(p->line, "pattern too long");
+    key  = (key  << 1) | (c == '1');
+    mask = (mask << 1) | (c != '?');
+  }
+  p->never = (key >> 32) != 0;
+  p->mask = mask;
+  p->val = key;
+}
+
+static char* skip_space(char *s) {
+  while (isspace((unsigned char)*s)) s ++;
+  return s;
+}
+
+static void parse_file(const char *file) {
+  FILE *fp = fopen(file, "r");
+  if (fp == NULL) { perror(file); exit(1); }
+  src_file = file;
+  nr_pat = 0;
+
+  char buf[MAX_LINE];
+  int line = 0;
+  enum { BEFORE, INSIDE, AFTER } state = BEFORE;
+  while (fgets(buf, sizeof(buf), fp) != NULL) {
+    line ++;
+    char *s = skip_space(buf);
+    if (strncmp(s, "//", 2) == 0 || strncmp(s, "#", 1) == 0) continue;
+    if (strstr(s, "INSTPAT_START(") != NULL) {
+      if (state != BEFORE) fail(line, "only one INSTPAT list is supported");
+      state = INSIDE;
+      continue;
+    }
+    if (strstr(s, "INSTPAT_END(") != NULL) {
+      if (state != INSIDE) fail(line, "INSTPAT_END() without INSTPAT_START()");
+      state = AFTER;
+      continue;
+    }
+    if (state != INSIDE || strncmp(s, "INSTPAT(", 8) != 0) continue;
+
+    if (nr_pat == MAX_PAT) fail(line, "too many patterns");
+    Pattern *p = &pat[nr_pat ++];
+    p->line = line;
+
+    // INSTPAT("pattern", name, ...) on a single line
+    s = skip_space(s + 8);
+    if (*s != '"') fail(line, "the pattern should be a string literal");
+    char *end = strchr(s + 1, '"');
+    if (end == NULL) fail(line, "the pattern should be on the same line as INSTPAT");
+    parse_pattern(p, s + 1, end - s - 1);
+
+    s = skip_space(end + 1);
+    if (*s != ',') fail(line, "missing instruction name");
+    s = skip_space(s + 1);
+    int n = 0;
+    while (s[n] != ',' && s[n] != ')' && s[n] != '\0' && !isspace((unsigned char)s[n])) n ++;
+    snprintf(p->name, sizeof(p->name), "%.*s", n, s);
+  }
+  fclose(fp);
+  if (state != AFTER) fail(line, "can not find the INSTPAT list");
+}
+
+static inline uint32_t field_mask(int lo, int len) {
+  return (uint32_t)(((1ull << len) - 1) << lo);
+}
+
+// Choose the field to switch on among the undecided bits of the first
+// pattern, preferring the one shared by most of the candidates.
+static void choose_field(const int *list, int n, uint32_t todo, int *lo, int *len) {
+  int best = -1;
+  for (int i = 0; i < 32; ) {
+    if (!(todo >> i & 1)) { i ++; continue; }
+    int j = i;
+    while (j < 32 && (todo >> j & 1)) j ++;
+    // [i, j) is a run of undecided bits, take its most significant part
+    int l = (j - i > MAX_FIELD ? j - MAX_FIELD : i);
+    uint32_t fmask = field_mask(l, j - l);
+    int score = 0;
+    for (int k = 0; k < n; k ++) {
+      if ((pat[list[k]].mask & fmask) == fmask) score ++;
+    }
+    if (score > best) { best = score; *lo = l; *len = j - l; }
+    i = j;
+  }
+}
+
+static Node* build(const int *list, int n, uint32_t decided, int depth) {
+  Node *node = calloc(1, sizeof(Node));
+  assert(node);
+  nr_node ++;
+  if (depth > max_depth) max_depth = depth;
+
+  if (n == 0) { node->idx = -1; return node; }
+  uint32_t todo = pat[list[0]].mask & ~decided;
+  // all bits of the first candidate are decided, so it must be matched
+  if (todo == 0) { node->idx = list[0]; return node; }
+
+  choose_field(list, n, todo, &node->lo, &node->len);
+  uint32_t fmask = field_mask(node->lo, node->len);
+  node->child = calloc(1u << node->len, sizeof(Node *));
+  int *sub = malloc(sizeof(int) * n);
+  assert(node->child && sub);
+  for (uint32_t v = 0; v < (1u << node->len); v ++) {
+    int m = 0;
+    for (int k = 0; k < n; k ++) {
+      Pattern *p = &pat[list[k]];
+      if (((p->val ^ (v << node->lo)) & p->mask & fmask) == 0) sub[m ++] = list[k];
+    }
+    node->child[v] = build(sub, m, decided | fmask, depth + 1);
+  }
+  free(sub);
+  return node;
+}
+
+static int eval(Node *node, uint32_t inst) {
+  while (node->child != NULL) {
+    node = node->child[(inst >> node->lo) & ((1u << node->len) - 1)];
+  }
+  return node->idx;
+}
+
+static int linear(uint32_t inst) {
+  for (int i = 0; i < nr_pat; i ++) {
+    if (!pat[i].never && (inst & pat[i].mask) == pat[i].val) return i;
+  }
+  return -1;
+}
+
+// --- code generation ---
+
+typedef struct { char *buf; size_t len, cap; } Str;
+
+static void str_printf(Str *s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void str_printf(Str *s, const char *fmt, ...) {
+  va_list ap;
+  while (true) {
+    va_start(ap, fmt);
+    int n = vsnprintf(s->buf + s->len, s->cap - s->len, fmt, ap);
+    va_end(ap);
+    if (s->len + n < s->cap) { s->len += n; return; }
+    s->cap = (s->cap == 0 ? 256 : s->cap * 2) + n;
+    s->buf = realloc(s->buf, s->cap);
+    assert(s->buf);
+  }
+}
+
+static char* emit(Node *node, int indent) {
+  Str s = {};
+  if (node->child == NULL) {
+    if (node->idx < 0) str_printf(&s, "return -1;\n");
+    else str_printf(&s, "return %d; // %s\n", node->idx, pat[node->idx].name);
+    return s.buf;
+  }
+
+  int nr = 1 << node->len;
+  char **code = calloc(nr, sizeof(char *));
+  assert(code);
+  for (int v = 0; v < nr; v ++) code[v] = emit(node->child[v], indent + 4);
+
+  // the most common child becomes the default case
+  int dflt = 0, dflt_cnt = 0;
+  for (int v = 0; v < nr; v ++) {
+    int cnt = 0;
+    for (int u = 0; u < nr; u ++) cnt += (strcmp(code[u], code[v]) == 0);
+    if (cnt > dflt_cnt) { dflt = v; dflt_cnt = cnt; }
+  }
+
+  str_printf(&s, "switch ((i >> %d) & 0x%x) {\n", node->lo, nr - 1);
+  bool *done = calloc(nr, sizeof(bool));
+  assert(done);
+  for (int v = 0; v < nr; v ++) {
+    if (done[v] || strcmp(code[v], code[dflt]) == 0) continue;
+    for (int u = v; u < nr; u ++) {
+      if (!done[u] && strcmp(code[u], code[v]) == 0) {
+        str_printf(&s, "%*scase 0x%x:\n", indent + 2, "", u);
+        done[u] = true;
+      }
+    }
+    str_printf(&s, "%*s%s", indent + 4, "", code[v]);
+  }
+  str_printf(&s, "%*sdefault:\n%*s%s", indent + 2, "", indent + 4, "", code[dflt]);
+  str_printf(&s, "%*s}\n", indent, "");
+
+  for (int v = 0; v < nr; v ++) free(code[v]);
+  free(code);
+  free(done);
+  return s.buf;
+}
+
+static void generate(Node *root, FILE *fp) {
+  fprintf(fp, "// Generated by tools/gen-decode from %s. Do not edit.\n\n", src_file);
+  fprintf(fp, "#ifndef __INSTPAT_TREE_H__\n#define __INSTPAT_TREE_H__\n\n");
+
+  fprintf(fp, "// labels of the patterns, which are defined by INSTPAT() with the line number\n");
+  fprintf(fp, "#define INSTPAT_TREE_TABLE { \\\n");
+  for (int i = 0; i < nr_pat; i ++) {
+    fprintf(fp, "  &&__instpat_match_%d, /* %s */ \\\n", pat[i].line, pat[i].name);
+  }
+  fprintf(fp, "}\n\n");
+
+  char *code = emit(root, 2);
+  fprintf(fp, "// return the index of the first pattern matched by `i', or -1 if none\n");
+  fprintf(fp, "static inline int instpat_tree(uint32_t i) {\n  %s}\n\n", code);
+  free(code);
+  fprintf(fp, "#endif\n");
+}
+
+// --- self-check ---
+
+static uint64_t seed = 0x20230901u;
+static uint32_t rand32() {
+  seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+  return seed;
+}
+
+static uint64_t nr_check = 0;
+
+static void check_one(Node *root, uint32_t inst) {
+  int expect = linear(inst), got = eval(root, inst);
+  nr_check ++;
+  if (expect != got) {
+    fprintf(stderr, "%s: mismatch on 0x%08x: the pattern list matches %s, but the tree matches %s\n",
+        src_file, inst, (expect < 0 ? "nothing" : pat[expect].name), (got < 0 ? "nothing" : pat[got].name));
+    exit(1);
+  }
+}
+
+static void self_check(Node *root) {
+  for (int i = 0; i < nr_pat; i ++) {
+    Pattern *p = &pat[i];
+    // instances of the pattern with random don't-care bits
+    for (int k = 0; k < 4096; k ++) check_one(root, p->val | (rand32() & ~p->mask));
+    // near misses with one of the fixed bits flipped
+    for (int b = 0; b < 32; b ++) {
+      if (!(p->mask >> b & 1)) continue;
+      for (int k = 0; k < 64; k ++) check_one(root, (p->val ^ (1u << b)) | (rand32() & ~p->mask));
+    }
+  }
+  for (int k = 0; k < (1 << 24); k ++) check_one(root, rand32());
+  printf("%s: %d patterns, %d nodes, depth %d, %" PRIu64 " encodings checked, OK\n",
+      src_file, nr_pat, nr_node, max_depth, nr_check);
+}
+
+int main(int argc, char *argv[]) {
+  const char *output = NULL;
+  bool check = false;
+  int o;
+  while ((o = getopt(argc, argv, "co:")) != -1) {
+    switch (o) {
+      case 'c': check = true; break;
+      case 'o': output = optarg; break;
+      default:
+        fprintf(stderr, "Usage: %s [-c] [-o OUTPUT] INST_C...\n\n"
+            "\t-c         check the decoder against the pattern list with sampled encodings\n"
+            "\t-o OUTPUT  write the decoder generated from the only INST_C to OUTPUT\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind == argc || (output != NULL && argc - optind != 1)) {
+    fprintf(stderr, "%s: expect %s input file\n", argv[0], output ? "one" : "at least one");
+    return 1;
+  }
+
+  for (int i = optind; i < argc; i ++) {
+    parse_file(argv[i]);
+    int list[MAX_PAT], n = 0;
+    for (int k = 0; k < nr_pat; k ++) {
+      if (!pat[k].never) list[n ++] = k;
+    }
+    nr_node = max_depth = nr_check = 0;
+    Node *root = build(list, n, 0, 0);
+
+    if (check) self_check(root);
+    if (output != NULL) {
+      FILE *fp = fopen(output, "w");
+      if (fp == NULL) { perror(output); return 1; }
+      generate(root, fp);
+      fclose(fp);
+    }
+  }
+  return 0;
+}